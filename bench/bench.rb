@@ -0,0 +1,201 @@
+# encoding: UTF-8
+#
+# Throughput of the bindings on a generated corpus, next to the bzip2
+# command line tool on the same data to show what the bindings cost on top
+# of libbzip2. Run it with
+#
+#    rake bench
+#
+# and tune it through the environment:
+#
+#    BENCH_SIZE    bytes of each corpus (4MB)
+#    BENCH_BLOCKS  block sizes to go through ("1-9", or e.g. "1,5,9")
+#    BENCH_CORPUS  corpora to use (all of them, e.g. "logs,json")
+#    BENCH_RUNS    runs of each measurement, the fastest one counts (3)
+#    BENCH_OUT     where the JSON results go (bench/results-VERSION.json)
+#
+# Every figure is MB/s (10**6 bytes) of uncompressed data. The corpus is
+# generated from a fixed seed, so runs on different releases see the same
+# bytes.
+require 'bzip2'
+require 'json'
+require 'stringio'
+require 'tmpdir'
+require 'benchmark'
+
+module Bzip2Bench
+  SEED = 20101116
+
+  module Corpus
+    WORDS = %w(the quick brown fox jumps over lazy dog lorem ipsum dolor sit
+      amet consectetur adipiscing elit sed do eiusmod tempor incididunt ut
+      labore et dolore magna aliqua)
+    PATHS = %w(/ /login /search /api/v1/items /api/v1/users /static/app.js
+      /static/app.css /favicon.ico)
+    LEVELS = %w(DEBUG INFO INFO INFO WARN ERROR)
+
+    module_function
+
+    def fill(size)
+      out = ''
+      out << yield(out.size) while out.size < size
+      out[0, size]
+    end
+
+    def logs(size)
+      t = 1_300_000_000
+      fill(size) do
+        t += rand(3)
+        "#{Time.at(t).utc.strftime('%Y-%m-%d %H:%M:%S')} #{LEVELS[rand(LEVELS.size)]} " \
+          "[worker-#{rand(8)}] GET #{PATHS[rand(PATHS.size)]}?id=#{rand(100_000)} " \
+          "#{[200, 200, 200, 304, 404, 500][rand(6)]} #{'%.4f' % (rand * 0.5)}s\n"
+      end
+    end
+
+    def json(size)
+      fill(size) do |i|
+        JSON.generate('id' => i, 'name' => "user#{rand(50_000)}",
+          'tags' => WORDS.values_at(rand(WORDS.size), rand(WORDS.size)),
+          'score' => (rand * 1000).round / 10.0, 'active' => rand(2) == 1) + "\n"
+      end
+    end
+
+    def random(size)
+      (0...size).map { rand(256) }.pack('C*')
+    end
+
+    def repetitive(size)
+      line = WORDS.join(' ') + "\n"
+      fill(size) { |i| i % 4096 == 0 ? "#{i}\n" : line }
+    end
+
+    def binary(size)
+      fill(size) do |i|
+        [i, rand(1000), rand(4), i * 3 % 65_536, rand * 100,
+          WORDS[rand(WORDS.size)]].pack('NnCnea16')
+      end
+    end
+
+    NAMES = %w(logs json random repetitive binary)
+
+    def generate(name, size)
+      srand(SEED)
+      data = send(name, size)
+      data.force_encoding('BINARY') if data.respond_to?(:force_encoding)
+      data
+    end
+  end
+
+  module_function
+
+  def env_list(name, default)
+    value = ENV[name] || default
+    value.split(',').map do |part|
+      part =~ /\A(\d+)-(\d+)\z/ ? ($1.to_i..$2.to_i).to_a : part
+    end.flatten
+  end
+
+  def measure(runs)
+    (1..runs).map { Benchmark.realtime { yield } }.min
+  end
+
+  def cli?
+    @cli = system('bzip2 --help > /dev/null 2>&1') if @cli.nil?
+    @cli
+  end
+
+  def cli_version
+    `bzip2 --help 2>&1`[/Version ([\d.]+)/, 1] if cli?
+  end
+
+  def run
+    size = (ENV['BENCH_SIZE'] || 4 << 20).to_i
+    runs = (ENV['BENCH_RUNS'] || 3).to_i
+    blocks = env_list('BENCH_BLOCKS', '1-9').map { |b| b.to_i }
+    corpora = env_list('BENCH_CORPUS', Corpus::NAMES.join(','))
+    out = ENV['BENCH_OUT'] ||
+      File.expand_path("../results-#{Bzip2::VERSION}.json", __FILE__)
+    results = []
+
+    record = lambda do |corpus, block, op, seconds, extra|
+      result = { 'corpus' => corpus, 'blocks' => block, 'op' => op,
+        'seconds' => seconds, 'mb_per_s' => size / seconds / 1e6 }
+      result.update(extra || {})
+      results << result
+      printf "%-11s %-5s %-16s %9.2f MB/s%s\n", corpus, block || '-', op,
+        result['mb_per_s'], result['overhead'] ? " (%.2fx the time of the cli)" % result['overhead'] : ''
+    end
+
+    Dir.mktmpdir('bzip2-bench') do |dir|
+      corpora.each do |corpus|
+        data = Corpus.generate(corpus, size)
+        plain = File.join(dir, corpus)
+        File.open(plain, 'wb') { |f| f << data }
+
+        compressed = Bzip2.compress(data)
+        record[corpus, nil, 'compress', measure(runs) { Bzip2.compress(data) },
+          'ratio' => compressed.size.to_f / size]
+        record[corpus, nil, 'uncompress', measure(runs) { Bzip2.uncompress(compressed) }, nil]
+
+        blocks.each do |block|
+          packed = File.join(dir, "#{corpus}.#{block}.bz2")
+          cli_compress = cli_decompress = nil
+          if cli?
+            cli_compress = measure(runs) { system("bzip2 -c -#{block} < #{plain} > #{packed}") }
+            cli_decompress = measure(runs) { system("bzip2 -dc < #{packed} > /dev/null") }
+            record[corpus, block, 'cli_compress', cli_compress, nil]
+            record[corpus, block, 'cli_decompress', cli_decompress, nil]
+          end
+
+          written = nil
+          seconds = measure(runs) do
+            writer = Bzip2::Writer.new nil, :blocks => block
+            pos = 0
+            while pos < size
+              writer.write data[pos, 65_536]
+              pos += 65_536
+            end
+            written = writer.close
+          end
+          record[corpus, block, 'writer_write', seconds,
+            'ratio' => written.size.to_f / size,
+            'overhead' => cli_compress && seconds / cli_compress]
+
+          seconds = measure(runs) { Bzip2::Reader.new(written).read }
+          record[corpus, block, 'reader_read', seconds,
+            'overhead' => cli_decompress && seconds / cli_decompress]
+          seconds = measure(runs) { Bzip2::Reader.new(written, :small => true).read }
+          record[corpus, block, 'reader_read_small', seconds, nil]
+          seconds = measure(runs) { Bzip2::Reader.new(written).each_line { |line| } }
+          record[corpus, block, 'each_line', seconds, nil]
+          seconds = measure(runs) do
+            reader = Bzip2::Reader.new(written)
+            while reader.gets('}')
+            end
+          end
+          record[corpus, block, 'gets_separator', seconds, nil]
+          seconds = measure(runs) do
+            reader = Bzip2::Reader.new(written)
+            while reader.gets('')
+            end
+          end
+          record[corpus, block, 'gets_paragraph', seconds, nil]
+        end
+      end
+    end
+
+    report = {
+      'version' => Bzip2::VERSION,
+      'ruby' => defined?(RUBY_DESCRIPTION) ? RUBY_DESCRIPTION : RUBY_VERSION,
+      'bzip2_cli' => cli_version,
+      'time' => Time.now.utc.strftime('%Y-%m-%dT%H:%M:%SZ'),
+      'size' => size,
+      'runs' => runs,
+      'results' => results
+    }
+    File.open(out, 'w') { |f| f << JSON.pretty_generate(report) << "\n" }
+    puts "results written to #{out}"
+  end
+end
+
+Bzip2Bench.run if $0 == __FILE__
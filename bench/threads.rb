@@ -0,0 +1,168 @@
+# encoding: UTF-8
+#
+# How compressing and decompressing scale over ruby threads. Every thread
+# works on streams of its own, so with libbzip2 running outside of the GVL
+# the aggregate throughput should grow with the number of threads up to the
+# number of cores. Run it with
+#
+#    rake bench:threads
+#
+# and tune it through the environment:
+#
+#    BENCH_SIZE     bytes of each stream (1MB)
+#    BENCH_THREADS  thread counts to go through ("1,2,4,8")
+#    BENCH_OPS      streams handled by every thread (8)
+#    BENCH_CORPUS   corpus the streams are cut from (logs)
+#    BENCH_BLOCKS   block size of the Writer and of the streams read (9)
+#    BENCH_OUT      where the JSON results go (bench/results-threads-VERSION.json)
+#
+# For each operation and thread count it reports the aggregate MB/s, the
+# speedup over one thread, the p50/p90/p99 latency of a single stream and
+# the CPU time of the process over the wall clock time, which stays around
+# 1.0 when everything runs under the GVL. With the gvltools gem installed
+# (ruby >= 3.2) the time threads spent waiting for the GVL is reported too.
+require 'thread'
+require File.expand_path('../bench', __FILE__)
+
+module Bzip2Bench
+  module Threads
+    OPS = %w(compress uncompress writer_write reader_read)
+
+    module_function
+
+    def gvl?
+      if @gvl.nil?
+        @gvl = begin
+          require 'gvltools'
+          GVLTools::GlobalTimer.enable
+          GVLTools::LocalTimer.enable
+          true
+        rescue LoadError, NotImplementedError
+          false
+        end
+      end
+      @gvl
+    end
+
+    def clock(id)
+      Process.clock_gettime(id)
+    rescue NameError, Errno::EINVAL
+      nil
+    end
+
+    def now
+      clock(Process::CLOCK_MONOTONIC) || Time.now.to_f
+    end
+
+    def cpu
+      clock(Process::CLOCK_PROCESS_CPUTIME_ID) || Process.times.utime + Process.times.stime
+    end
+
+    def percentile(sorted, p)
+      sorted[[(sorted.size * p).ceil - 1, 0].max]
+    end
+
+    def operation(op, data, compressed, block)
+      case op
+      when 'compress'
+        lambda { Bzip2.compress(data) }
+      when 'uncompress'
+        lambda { Bzip2.uncompress(compressed) }
+      when 'writer_write'
+        lambda do
+          writer = Bzip2::Writer.new nil, :blocks => block
+          pos = 0
+          while pos < data.size
+            writer.write data[pos, 65_536]
+            pos += 65_536
+          end
+          writer.close
+        end
+      when 'reader_read'
+        lambda { Bzip2::Reader.new(compressed).read }
+      end
+    end
+
+    # runs ops streams on each of count threads, every thread with its own
+    # copy of the data
+    def round(op, count, ops, data, compressed, block)
+      start = Queue.new
+      threads = (1..count).map do
+        Thread.new(data.dup, compressed.dup) do |mine, packed|
+          work = operation(op, mine, packed, block)
+          work.call
+          GVLTools::LocalTimer.reset if gvl?
+          start.pop
+          latencies = (1..ops).map do
+            t = now
+            work.call
+            now - t
+          end
+          [latencies, gvl? ? GVLTools::LocalTimer.monotonic_time / 1e9 : nil]
+        end
+      end
+      Thread.pass until threads.all? { |t| t.status == 'sleep' || !t.alive? }
+      GVLTools::GlobalTimer.reset if gvl?
+      cpu0, wall0 = cpu, now
+      count.times { start << true }
+      done = threads.map { |t| t.value }
+      wall, cpu_time = now - wall0, cpu - cpu0
+      [done, wall, cpu_time, gvl? ? GVLTools::GlobalTimer.monotonic_time / 1e9 : nil]
+    end
+
+    def run
+      size = (ENV['BENCH_SIZE'] || 1 << 20).to_i
+      ops = (ENV['BENCH_OPS'] || 8).to_i
+      block = (ENV['BENCH_BLOCKS'] || 9).to_i
+      counts = Bzip2Bench.env_list('BENCH_THREADS', '1,2,4,8').map { |c| c.to_i }
+      corpus = ENV['BENCH_CORPUS'] || 'logs'
+      out = ENV['BENCH_OUT'] ||
+        File.expand_path("../results-threads-#{Bzip2::VERSION}.json", __FILE__)
+      data = Corpus.generate(corpus, size)
+      writer = Bzip2::Writer.new nil, :blocks => block
+      writer.write data
+      compressed = writer.close
+      results = []
+
+      puts "gvltools not available, GVL wait times are not recorded" unless gvl?
+      OPS.each do |op|
+        single = nil
+        counts.each do |count|
+          done, wall, cpu_time, gvl_wait = round(op, count, ops, data, compressed, block)
+          latencies = done.map { |l, _| l }.flatten.sort
+          mb_per_s = count * ops * size / wall / 1e6
+          single ||= mb_per_s
+          result = {
+            'op' => op, 'threads' => count, 'streams' => count * ops,
+            'seconds' => wall, 'mb_per_s' => mb_per_s,
+            'speedup' => mb_per_s / single,
+            'p50' => percentile(latencies, 0.5),
+            'p90' => percentile(latencies, 0.9),
+            'p99' => percentile(latencies, 0.99),
+            'cpu_per_wall' => cpu_time / wall,
+            'gvl_wait' => gvl_wait,
+            'gvl_wait_per_thread' => gvl_wait && done.map { |_, w| w }
+          }
+          results << result
+          printf "%-13s %3d threads %9.2f MB/s %5.2fx  p50 %7.1fms p90 %7.1fms p99 %7.1fms  cpu/wall %5.2f%s\n",
+            op, count, mb_per_s, result['speedup'], result['p50'] * 1e3,
+            result['p90'] * 1e3, result['p99'] * 1e3, result['cpu_per_wall'],
+            gvl_wait ? "  gvl wait %.1fms" % (gvl_wait * 1e3) : ''
+        end
+      end
+
+      report = {
+        'version' => Bzip2::VERSION,
+        'ruby' => defined?(RUBY_DESCRIPTION) ? RUBY_DESCRIPTION : RUBY_VERSION,
+        'time' => Time.now.utc.strftime('%Y-%m-%dT%H:%M:%SZ'),
+        'corpus' => corpus, 'size' => size, 'ops' => ops, 'blocks' => block,
+        'gvltools' => gvl?,
+        'results' => results
+      }
+      File.open(out, 'w') { |f| f << JSON.pretty_generate(report) << "\n" }
+      puts "results written to #{out}"
+    end
+  end
+end
+
+Bzip2Bench::Threads.run if $0 == __FILE__
@@ -4,48 +4,83 @@
 #include "common.h"
 #include "reader.h"
 #include "writer.h"
+#include "parallel.h"
+#include "index.h"
 
-VALUE bz_cWriter, bz_cReader, bz_cInternal;
+VALUE bz_cWriter, bz_cReader, bz_cInternal, bz_cInternalMap;
+VALUE bz_cParallelWriter, bz_cParallelReader, bz_cIndex;
 VALUE bz_eError, bz_eEOZError;
 
-VALUE bz_internal_ary;
+st_table *bz_internal_ios;
 
 ID id_new, id_write, id_open, id_flush, id_read;
-ID id_closed, id_close, id_str;
+ID id_closed, id_close, id_str, id_initialize;
 
+int bz_internal_collect_i(st_data_t key, st_data_t val, st_data_t arg) {
+    struct bz_iv *bziv = (struct bz_iv *) val;
+
+    if (!NIL_P(bziv->bz2)) {
+        rb_ary_push((VALUE) arg, bziv->bz2);
+    }
+    return ST_CONTINUE;
+}
+
+/*
+ * Flushes the writers which weren't closed. The registry doesn't keep them
+ * alive, so they're gathered with the garbage collector off first: flushing
+ * one could otherwise collect the next.
+ */
 void bz_internal_finalize(VALUE data) {
-    VALUE elem;
-    int closed, i;
-    struct bz_iv *bziv;
+    VALUE writers = rb_ary_new(), disabled;
     struct bz_file *bzf;
+    int closed;
+    long i;
 
-    for (i = 0; i < RARRAY_LEN(bz_internal_ary); i++) {
-        elem = RARRAY_PTR(bz_internal_ary)[i];
-        Data_Get_Struct(elem, struct bz_iv, bziv);
-        if (bziv->bz2) {
-            RDATA(bziv->bz2)->dfree = free;
-            if (TYPE(bziv->io) == T_FILE) {
-                RFILE(bziv->io)->fptr->finalize = bziv->finalize;
-            } else if (TYPE(bziv->io) == T_DATA) {
-                RDATA(bziv->io)->dfree = bziv->finalize;
-            }
-            Data_Get_Struct(bziv->bz2, struct bz_file, bzf);
-            closed = bz_writer_internal_flush(bzf);
-            if (bzf->flags & BZ2_RB_CLOSE) {
-                bzf->flags &= ~BZ2_RB_CLOSE;
-                if (!closed && rb_respond_to(bzf->io, id_close)) {
-                    rb_funcall2(bzf->io, id_close, 0, 0);
-                }
+    disabled = rb_gc_disable();
+    st_foreach(bz_internal_ios, bz_internal_collect_i, writers);
+    if (!RTEST(disabled)) {
+        rb_gc_enable();
+    }
+    for (i = 0; i < RARRAY_LEN(writers); i++) {
+        Data_Get_BZ2(RARRAY_PTR(writers)[i], bzf);
+        closed = bz_writer_internal_flush(bzf);
+        if (bzf->flags & BZ2_RB_CLOSE) {
+            bzf->flags &= ~BZ2_RB_CLOSE;
+            if (!closed && rb_respond_to(bzf->io, id_close)) {
+                rb_funcall2(bzf->io, id_close, 0, 0);
             }
         }
     }
+    RB_GC_GUARD(writers);
+}
+
+struct bz_oneshot {
+    bz_stream bzs;
+    VALUE data, res;
+    char *out;
+    unsigned int outlen;
+    int blocks, state;
+    double time;
+};
+
+void * bz_compress_i(void *ptr) {
+    struct bz_oneshot *arg = ptr;
+    double start = bz_now();
+
+    arg->state = bz_buff_compress(arg->out, &arg->outlen,
+        RSTRING_PTR(arg->data), (unsigned int) RSTRING_LEN(arg->data),
+        arg->blocks, 0);
+    arg->time = bz_now() - start;
+    return 0;
 }
 
 /*
  * call-seq:
  *   compress(str)
  *
- * Shortcut for compressing just a string.
+ * Shortcut for compressing just a string. The block size is the smallest
+ * one which holds all of +str+, so small strings don't pay for the memory
+ * of 900k blocks.
  *
  *    Bzip2.uncompress Bzip2.compress('data') # => 'data'
  *
@@ -56,10 +91,32 @@ VALUE bz_compress(VALUE self, VALUE str) {
     VALUE bz2, argv[1] = {Qnil};
 
     str = rb_str_to_str(str);
+    if (RSTRING_LEN(str) <= BZ_RB_ONESHOT_MAX) {
+        struct bz_oneshot arg;
+        unsigned int len = (unsigned int) RSTRING_LEN(str);
+
+        /* the worst case documented by libbzip2, so a single call will do */
+        arg.outlen = len + len / 100 + 600;
+        arg.blocks = bz_auto_blocks(len);
+        arg.data = rb_str_new_frozen(str);
+        arg.res = rb_str_new(0, arg.outlen);
+        arg.out = RSTRING_PTR(arg.res);
+        bz_blocking_call(0, bz_compress_i, &arg, 0, 0);
+        bz_stats_lib(0, 1, len, arg.outlen, arg.time);
+        if (arg.state != BZ_OK) {
+            bz_raise(arg.state);
+        }
+        rb_str_resize(arg.res, arg.outlen);
+        if (OBJ_TAINTED(str)) {
+            OBJ_TAINT(arg.res);
+        }
+        RB_GC_GUARD(arg.data);
+        return arg.res;
+    }
     bz2 = rb_funcall2(bz_cWriter, id_new, 1, argv);
     if (OBJ_TAINTED(str)) {
         struct bz_file *bzf;
-        Data_Get_Struct(bz2, struct bz_file, bzf);
+        Data_Get_BZ2(bz2, bzf);
         OBJ_TAINT(bzf->io);
     }
     bz_writer_write(bz2, str);
@@ -83,16 +140,16 @@ VALUE bz_to_io(VALUE obj) {
 VALUE bz_str_read(int argc, VALUE *argv, VALUE obj) {
     struct bz_str *bzs;
     VALUE res, len;
-    int count;
+    long count;
 
     Data_Get_Struct(obj, struct bz_str, bzs);
     rb_scan_args(argc, argv, "01", &len);
     if (NIL_P(len)) {
-        count = (int) RSTRING_LEN(bzs->str);
+        count = RSTRING_LEN(bzs->str);
     } else {
-        count = NUM2INT(len);
+        count = NUM2LONG(len);
         if (count < 0) {
-            rb_raise(rb_eArgError, "negative length %d given", count);
+            rb_raise(rb_eArgError, "negative length %ld given", count);
         }
     }
     if (!count || bzs->pos == -1) {
@@ -109,6 +166,66 @@ VALUE bz_str_read(int argc, VALUE *argv, VALUE obj) {
     return res;
 }
 
+void * bz_uncompress_i(void *ptr) {
+    struct bz_oneshot *arg = ptr;
+    double start = bz_now();
+
+    arg->state = BZ2_bzDecompress(&(arg->bzs));
+    arg->time = bz_now() - start;
+    return 0;
+}
+
+/*
+ * Decompresses into a single string which grows geometrically and is cut
+ * down to size in the end.
+ */
+VALUE bz_uncompress_body(VALUE ptr) {
+    struct bz_oneshot *arg = (struct bz_oneshot *)ptr;
+    long size, len = 0;
+    unsigned int in, out;
+
+    size = RSTRING_LEN(arg->data) * 4;
+    if (size < BZ_RB_BLOCKSIZE) {
+        size = BZ_RB_BLOCKSIZE;
+    } else if (size > BZ_RB_ONESHOT_MAX / 16) {
+        size = BZ_RB_ONESHOT_MAX / 16;
+    }
+    arg->res = rb_str_new(0, size);
+    arg->bzs.next_in = RSTRING_PTR(arg->data);
+    arg->bzs.avail_in = (unsigned int) RSTRING_LEN(arg->data);
+    while (1) {
+        arg->bzs.next_out = RSTRING_PTR(arg->res) + len;
+        arg->bzs.avail_out = (unsigned int) (size - len > BZ_RB_ONESHOT_MAX ?
+            BZ_RB_ONESHOT_MAX : size - len);
+        len += arg->bzs.avail_out;
+        in = arg->bzs.avail_in;
+        out = arg->bzs.avail_out;
+        bz_blocking_call(0, bz_uncompress_i, arg, 0, 0);
+        bz_stats_lib(0, 1, in - arg->bzs.avail_in, out - arg->bzs.avail_out,
+            arg->time);
+        len -= arg->bzs.avail_out;
+        if (arg->state == BZ_STREAM_END) {
+            break;
+        }
+        if (arg->state != BZ_OK) {
+            bz_raise(arg->state);
+        }
+        if (len == size) {
+            size *= 2;
+            rb_str_resize(arg->res, size);
+        } else if (!arg->bzs.avail_in) {
+            bz_raise(BZ_UNEXPECTED_EOF);
+        }
+    }
+    rb_str_resize(arg->res, len);
+    return arg->res;
+}
+
+VALUE bz_uncompress_ensure(VALUE ptr) {
+    BZ2_bzDecompressEnd(&((struct bz_oneshot *)ptr)->bzs);
+    return Qnil;
+}
+
 /*
  * call-seq:
  *    uncompress(data)
@@ -121,11 +238,33 @@ VALUE bz_str_read(int argc, VALUE *argv, VALUE obj) {
  * @raise [Bzip2::Error] if +data+ is not valid bz2 data
  */
 VALUE bz_uncompress(VALUE self, VALUE data) {
-    VALUE bz2, nilv = Qnil, argv[1];
+    VALUE bz2, res, nilv = Qnil, argv[1];
 
-    argv[0] = rb_str_to_str(data);
+    data = rb_str_to_str(data);
+    if (RSTRING_LEN(data) <= BZ_RB_ONESHOT_MAX) {
+        struct bz_oneshot arg;
+
+        MEMZERO(&arg, struct bz_oneshot, 1);
+        arg.bzs.bzalloc = bz_malloc;
+        arg.bzs.bzfree = bz_free;
+        arg.data = rb_str_new_frozen(data);
+        arg.res = Qnil;
+        if ((arg.state = BZ2_bzDecompressInit(&arg.bzs, 0, 0)) != BZ_OK) {
+            bz_raise(arg.state);
+        }
+        res = rb_ensure(bz_uncompress_body, (VALUE)&arg,
+            bz_uncompress_ensure, (VALUE)&arg);
+        if (OBJ_TAINTED(data)) {
+            OBJ_TAINT(res);
+        }
+        RB_GC_GUARD(arg.data);
+        return res;
+    }
+    argv[0] = data;
     bz2 = rb_funcall2(bz_cReader, id_new, 1, argv);
-    return bz_reader_read(1, &nilv, bz2);
+    res = bz_reader_read(1, &nilv, bz2);
+    RB_GC_GUARD(bz2);
+    return res;
 }
 
 /*
@@ -144,8 +283,11 @@ VALUE bz_s_new(int argc, VALUE *argv, VALUE obj) {
 void Init_bzip2() {
     VALUE bz_mBzip2, bz_mBzip2Singleton;
 
-    bz_internal_ary = rb_ary_new();
-    rb_global_variable(&bz_internal_ary);
+#ifdef HAVE_RB_EXT_RACTOR_SAFE
+    rb_ext_ractor_safe(1);
+#endif
+    bz_main_ractor_init();
+    bz_internal_ios = st_init_numtable();
     rb_set_end_proc(bz_internal_finalize, Qnil);
 
     id_new    = rb_intern("new");
@@ -156,6 +298,7 @@ void Init_bzip2() {
     id_close  = rb_intern("close");
     id_closed = rb_intern("closed?");
     id_str    = rb_intern("to_str");
+    id_initialize = rb_intern("initialize");
 
     bz_mBzip2    = rb_define_module("Bzip2");
     bz_eError    = rb_define_class_under(bz_mBzip2, "Error", rb_eIOError);
@@ -167,6 +310,11 @@ void Init_bzip2() {
     rb_define_alias(bz_mBzip2Singleton, "bzip2",      "compress");
     rb_define_alias(bz_mBzip2Singleton, "decompress", "uncompress");
     rb_define_alias(bz_mBzip2Singleton, "bunzip2",    "uncompress");
+    rb_define_singleton_method(bz_mBzip2, "pool_limit",  bz_s_pool_limit,     0);
+    rb_define_singleton_method(bz_mBzip2, "pool_limit=", bz_s_set_pool_limit, 1);
+    rb_define_singleton_method(bz_mBzip2, "pool_size",   bz_s_pool_size,      0);
+    rb_define_singleton_method(bz_mBzip2, "pool_trim",   bz_s_pool_trim,      0);
+    rb_define_singleton_method(bz_mBzip2, "stats",       bz_s_stats,          0);
 
     /*
       Writer
@@ -189,11 +337,20 @@ void Init_bzip2() {
     rb_define_method(bz_cWriter, "flush",           bz_writer_flush,      0);
     rb_define_method(bz_cWriter, "close",           bz_writer_close,      0);
     rb_define_method(bz_cWriter, "close!",          bz_writer_close_bang, 0);
+    rb_define_method(bz_cWriter, "reset",           bz_writer_reset,     -1);
+    rb_define_method(bz_cWriter, "index",           bz_writer_index,     0);
+    rb_define_method(bz_cWriter, "stats",           bz_file_stats,       0);
     rb_define_method(bz_cWriter, "closed?",         bz_writer_closed,     0);
     rb_define_method(bz_cWriter, "to_io",           bz_to_io,             0);
     rb_define_alias(bz_cWriter, "finish", "flush");
     rb_define_alias(bz_cWriter, "closed", "closed?");
 
+    /*
+      ParallelWriter
+    */
+    bz_cParallelWriter = rb_define_class_under(bz_mBzip2, "ParallelWriter", bz_cWriter);
+    rb_define_method(bz_cParallelWriter, "initialize", bz_pwriter_init, -1);
+
     /*
       Reader
     */
@@ -206,6 +363,7 @@ void Init_bzip2() {
 #endif
     rb_define_singleton_method(bz_cReader, "new",       bz_s_new,         -1);
     rb_define_singleton_method(bz_cReader, "open",      bz_reader_s_open, -1);
+    rb_define_singleton_method(bz_cReader, "mmap",      bz_reader_s_mmap, -1);
     rb_define_singleton_method(bz_cReader, "foreach",   bz_reader_s_foreach,   -1);
     rb_define_singleton_method(bz_cReader, "readlines", bz_reader_s_readlines, -1);
     rb_define_method(bz_cReader, "initialize",  bz_reader_init,      -1);
@@ -224,16 +382,46 @@ void Init_bzip2() {
     rb_define_method(bz_cReader, "close",       bz_reader_close,      0);
     rb_define_method(bz_cReader, "close!",      bz_reader_close_bang, 0);
     rb_define_method(bz_cReader, "finish",      bz_reader_finish,     0);
+    rb_define_method(bz_cReader, "reset",       bz_reader_reset,     -1);
     rb_define_method(bz_cReader, "closed?",     bz_reader_closed,     0);
     rb_define_method(bz_cReader, "eoz?",        bz_reader_eoz,        0);
     rb_define_method(bz_cReader, "eof?",        bz_reader_eof,        0);
     rb_define_method(bz_cReader, "lineno",      bz_reader_lineno,     0);
     rb_define_method(bz_cReader, "lineno=",     bz_reader_set_lineno, 1);
+    rb_define_method(bz_cReader, "seek",        bz_reader_seek,       1);
+    rb_define_method(bz_cReader, "seek_line",   bz_reader_seek_line,  1);
+    rb_define_method(bz_cReader, "pos",         bz_reader_pos,        0);
+    rb_define_method(bz_cReader, "stats",       bz_file_stats,        0);
     rb_define_method(bz_cReader, "to_io",       bz_to_io,             0);
     rb_define_alias(bz_cReader, "each_line", "each");
     rb_define_alias(bz_cReader, "closed", "closed?");
     rb_define_alias(bz_cReader, "eoz", "eoz?");
     rb_define_alias(bz_cReader, "eof", "eof?");
+    rb_define_alias(bz_cReader, "tell", "pos");
+
+    /*
+      ParallelReader
+    */
+    bz_cParallelReader = rb_define_class_under(bz_mBzip2, "ParallelReader", bz_cReader);
+    rb_define_method(bz_cParallelReader, "initialize", bz_preader_init, -1);
+
+    /*
+      Index
+    */
+    bz_cIndex = rb_define_class_under(bz_mBzip2, "Index", rb_cObject);
+#if HAVE_RB_DEFINE_ALLOC_FUNC
+    rb_define_alloc_func(bz_cIndex, bz_index_s_alloc);
+#else
+    rb_define_singleton_method(bz_cIndex, "allocate", bz_index_s_alloc, 0);
+#endif
+    rb_define_singleton_method(bz_cIndex, "build", bz_index_s_build, -1);
+    rb_define_singleton_method(bz_cIndex, "load",  bz_index_s_load,   1);
+    rb_define_singleton_method(bz_cIndex, "_load", bz_index_s_load,   1);
+    rb_define_method(bz_cIndex, "size",   bz_index_size,         0);
+    rb_define_method(bz_cIndex, "lines",  bz_index_lines,        0);
+    rb_define_method(bz_cIndex, "blocks", bz_index_blocks,       0);
+    rb_define_method(bz_cIndex, "dump",   bz_index_dump,         0);
+    rb_define_method(bz_cIndex, "_dump",  bz_index_marshal_dump, 1);
 
     /*
       Internal
@@ -247,4 +435,14 @@ void Init_bzip2() {
     rb_undef_method(CLASS_OF(bz_cInternal), "new");
     rb_undef_method(bz_cInternal, "initialize");
     rb_define_method(bz_cInternal, "read", bz_str_read, -1);
+
+    bz_cInternalMap = rb_define_class_under(bz_mBzip2, "InternalMap", rb_cData);
+#if HAVE_RB_DEFINE_ALLOC_FUNC
+    rb_undef_alloc_func(bz_cInternalMap);
+#else
+    rb_undef_method(CLASS_OF(bz_cInternalMap), "allocate");
+#endif
+    rb_undef_method(CLASS_OF(bz_cInternalMap), "new");
+    rb_undef_method(bz_cInternalMap, "initialize");
+    rb_define_method(bz_cInternalMap, "read", bz_map_read, -1);
 }
@@ -1,19 +1,706 @@
 #include <ruby.h>
 #include <bzlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/time.h>
+#ifdef HAVE_PTHREAD_H
+#  include <pthread.h>
+#endif
 
 #include "common.h"
+#include "parallel.h"
+
+#ifndef RUBY_UBF_IO
+#  define RUBY_UBF_IO 0
+#endif
 
 void bz_file_mark(struct bz_file * bzf) {
     rb_gc_mark(bzf->io);
     rb_gc_mark(bzf->in);
+    rb_gc_mark(bzf->index);
 }
 
+/*
+ * What ObjectSpace.memsize_of reports for a Reader or Writer: the buffers
+ * and the working memory of libbzip2, which is most of it.
+ */
+size_t bz_file_memsize(const void *ptr) {
+    const struct bz_file *bzf = ptr;
+    size_t size = sizeof(struct bz_file) + bzf->mem;
+
+    if (bzf->buf) {
+        size += bzf->buflen;
+    }
+    if (bzf->spare) {
+        size += bzf->sparelen;
+    }
+    if (bzf->pw) {
+        size += bzf->pw->chunksize + bzf->pw->inflight;
+    }
+    if (bzf->pr) {
+        size += bzf->pr->datasize;
+    }
+    return size;
+}
+
+#ifdef HAVE_RB_DATA_TYPE_T_PARENT
+/* the parent of the Reader and Writer types, which share struct bz_file */
+const rb_data_type_t bz_file_type = {
+    "Bzip2::File",
+    {(RUBY_DATA_FUNC)bz_file_mark, 0, bz_file_memsize},
+};
+#endif
+
+/*
+ * Streams of a Reader or Writer have their bz_file as opaque, and what
+ * libbzip2 allocates for them is counted there. Decompression allocates
+ * from within BZ2_bzDecompress, without the GVL, so the garbage collector
+ * is only told about it later by bz_mem_report.
+ */
+void bz_mem_report(struct bz_file *bzf) {
+#ifdef HAVE_RB_GC_ADJUST_MEMORY_USAGE
+    if (bzf->mem != bzf->memgc) {
+        rb_gc_adjust_memory_usage((ssize_t) bzf->mem - (ssize_t) bzf->memgc);
+        bzf->memgc = bzf->mem;
+    }
+#endif
+}
+
+/*
+ * libbzip2 allocates a few large arrays per stream (several megabytes for
+ * compression, up to 3.6M for decompression) in sizes which only depend on
+ * the block size. Instead of handing them back to the system they're kept
+ * in a process wide pool, in classes of BZ_MEM_CLASS bytes, up to
+ * bz_mem_limit bytes in total. Streams run on native threads too, hence the
+ * lock.
+ */
+#define BZ_MEM_MIN     (16 * 1024)
+#define BZ_MEM_CLASS   (64 * 1024)
+#define BZ_MEM_CLASSES 64
+#define BZ_MEM_POOLED(size) \
+    ((size) >= BZ_MEM_MIN && (size) <= BZ_MEM_CLASS * BZ_MEM_CLASSES)
+
+union bz_chunk {
+    struct {
+        size_t size;            /* pooled if within the size classes */
+        union bz_chunk *next;
+    } h;
+    double align[2];
+};
+
+union bz_chunk *bz_mem_lists[BZ_MEM_CLASSES + 1];
+size_t bz_mem_held = 0, bz_mem_limit = BZ_MEM_LIMIT;
+#ifdef HAVE_PTHREAD_H
+pthread_mutex_t bz_mem_lock = PTHREAD_MUTEX_INITIALIZER;
+#  define BZ_MEM_LOCK()   pthread_mutex_lock(&bz_mem_lock)
+#  define BZ_MEM_UNLOCK() pthread_mutex_unlock(&bz_mem_lock)
+#else
+#  define BZ_MEM_LOCK()
+#  define BZ_MEM_UNLOCK()
+#endif
+
 void * bz_malloc(void *opaque, int m, int n) {
-    return malloc(m * n);
+    size_t size = (size_t) m * n, cls = 0;
+    union bz_chunk *chunk = 0;
+
+    if (BZ_MEM_POOLED(size)) {
+        cls = (size + BZ_MEM_CLASS - 1) / BZ_MEM_CLASS;
+        size = cls * BZ_MEM_CLASS;
+        BZ_MEM_LOCK();
+        if ((chunk = bz_mem_lists[cls])) {
+            bz_mem_lists[cls] = chunk->h.next;
+            bz_mem_held -= size;
+        }
+        BZ_MEM_UNLOCK();
+    }
+    if (!chunk) {
+        if (!(chunk = malloc(sizeof(union bz_chunk) + size))) {
+            return 0;
+        }
+        chunk->h.size = size;
+    }
+    if (opaque) {
+        ((struct bz_file *) opaque)->mem += size;
+    }
+    return chunk + 1;
 }
 
 void bz_free(void *opaque, void *p) {
-    free(p);
+    union bz_chunk *chunk = (union bz_chunk *)p - 1;
+    size_t size = chunk->h.size;
+
+    if (opaque) {
+        ((struct bz_file *) opaque)->mem -= size;
+    }
+    if (BZ_MEM_POOLED(size)) {
+        BZ_MEM_LOCK();
+        if (bz_mem_held + size <= bz_mem_limit) {
+            chunk->h.next = bz_mem_lists[size / BZ_MEM_CLASS];
+            bz_mem_lists[size / BZ_MEM_CLASS] = chunk;
+            bz_mem_held += size;
+            chunk = 0;
+        }
+        BZ_MEM_UNLOCK();
+    }
+    if (chunk) {
+        free(chunk);
+    }
+}
+
+/*
+ * Frees pooled memory until no more than +keep+ bytes are left, returns
+ * the number of bytes freed.
+ */
+size_t bz_mem_trim(size_t keep) {
+    union bz_chunk *chunk, *list = 0;
+    size_t freed = 0;
+    int i;
+
+    BZ_MEM_LOCK();
+    for (i = BZ_MEM_CLASSES; i > 0 && bz_mem_held > keep; i--) {
+        while ((chunk = bz_mem_lists[i]) && bz_mem_held > keep) {
+            bz_mem_lists[i] = chunk->h.next;
+            bz_mem_held -= chunk->h.size;
+            freed += chunk->h.size;
+            chunk->h.next = list;
+            list = chunk;
+        }
+    }
+    BZ_MEM_UNLOCK();
+    while ((chunk = list)) {
+        list = chunk->h.next;
+        free(chunk);
+    }
+    return freed;
+}
+
+/*
+ * call-seq:
+ *    pool_limit -> Integer
+ *
+ * The number of bytes of libbzip2 working memory which is kept around for
+ * reuse by later streams instead of being freed.
+ *
+ * @return [Integer] the limit in bytes
+ */
+VALUE bz_s_pool_limit(VALUE self) {
+    size_t limit;
+
+    BZ_MEM_LOCK();
+    limit = bz_mem_limit;
+    BZ_MEM_UNLOCK();
+    return SIZET2NUM(limit);
+}
+
+/*
+ * call-seq:
+ *    pool_limit = bytes
+ *
+ * Sets the number of bytes of libbzip2 working memory which may be kept for
+ * reuse. Memory above the new limit is freed right away, 0 turns pooling
+ * off.
+ *
+ *    Bzip2.pool_limit = 64 << 20
+ *
+ * @param [Integer] bytes the new limit
+ */
+VALUE bz_s_set_pool_limit(VALUE self, VALUE limit) {
+    size_t keep = NUM2SIZET(limit);
+
+    BZ_MEM_LOCK();
+    bz_mem_limit = keep;
+    BZ_MEM_UNLOCK();
+    bz_mem_trim(keep);
+    return limit;
+}
+
+/*
+ * call-seq:
+ *    pool_size -> Integer
+ *
+ * @return [Integer] the number of bytes currently held by the pool
+ */
+VALUE bz_s_pool_size(VALUE self) {
+    size_t held;
+
+    BZ_MEM_LOCK();
+    held = bz_mem_held;
+    BZ_MEM_UNLOCK();
+    return SIZET2NUM(held);
+}
+
+/*
+ * call-seq:
+ *    pool_trim -> Integer
+ *
+ * Frees all the memory held by the pool.
+ *
+ * @return [Integer] the number of bytes freed
+ */
+VALUE bz_s_pool_trim(VALUE self) {
+    return SIZET2NUM(bz_mem_trim(0));
+}
+
+/*
+ * Counters of all streams together. Holding the GVL isn't enough to update
+ * them since every ractor has a lock of its own.
+ */
+struct bz_stats bz_stats_total;
+#ifdef HAVE_PTHREAD_H
+pthread_mutex_t bz_stats_lock = PTHREAD_MUTEX_INITIALIZER;
+#  define BZ_STATS_LOCK()   pthread_mutex_lock(&bz_stats_lock)
+#  define BZ_STATS_UNLOCK() pthread_mutex_unlock(&bz_stats_lock)
+#else
+#  define BZ_STATS_LOCK()
+#  define BZ_STATS_UNLOCK()
+#endif
+
+#ifdef HAVE_RB_RACTOR_LOCAL_STORAGE_VALUE_NEWKEY
+/*
+ * Set in the storage of the main ractor only, which is where the extension
+ * gets loaded
+ */
+rb_ractor_local_key_t bz_main_key;
+#endif
+
+void bz_main_ractor_init(void) {
+#ifdef HAVE_RB_RACTOR_LOCAL_STORAGE_VALUE_NEWKEY
+    bz_main_key = rb_ractor_local_storage_value_newkey();
+    rb_ractor_local_storage_value_set(bz_main_key, Qtrue);
+#endif
+}
+
+/*
+ * Only writers of the main ractor are registered with their io (see
+ * writer.c), so the registry is never touched from two ractors at once.
+ */
+int bz_main_ractor_p(void) {
+#ifdef HAVE_RB_RACTOR_LOCAL_STORAGE_VALUE_NEWKEY
+    VALUE v;
+
+    return rb_ractor_local_storage_value_lookup(bz_main_key, &v);
+#else
+    return 1;
+#endif
+}
+
+/*
+ * Seconds on a monotonic clock, safe to call without the GVL
+ */
+double bz_now(void) {
+#if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_MONOTONIC)
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0) {
+        return ts.tv_sec + ts.tv_nsec / 1e9;
+    }
+#endif
+    {
+        struct timeval tv;
+
+        gettimeofday(&tv, 0);
+        return tv.tv_sec + tv.tv_usec / 1e6;
+    }
+}
+
+/*
+ * Accounts for calls into libbzip2 which took time seconds, consumed in and
+ * produced out bytes. bzf may be NULL for Bzip2.compress and friends.
+ */
+void bz_stats_lib(struct bz_file *bzf, unsigned long calls,
+    unsigned long long in, unsigned long long out, double time) {
+    BZ_STATS_LOCK();
+    bz_stats_total.calls += calls;
+    bz_stats_total.in += in;
+    bz_stats_total.out += out;
+    bz_stats_total.libtime += time;
+    BZ_STATS_UNLOCK();
+    if (bzf) {
+        bzf->stats.calls += calls;
+        bzf->stats.in += in;
+        bzf->stats.out += out;
+        bzf->stats.libtime += time;
+    }
+}
+
+/*
+ * Accounts for one read from or write to the io which started at since
+ */
+void bz_stats_io(struct bz_file *bzf, int writing, double since) {
+    double time = bz_now() - since;
+
+    BZ_STATS_LOCK();
+    if (writing) {
+        bzf->stats.writes++;
+        bz_stats_total.writes++;
+    } else {
+        bzf->stats.reads++;
+        bz_stats_total.reads++;
+    }
+    bzf->stats.iotime += time;
+    bz_stats_total.iotime += time;
+    BZ_STATS_UNLOCK();
+}
+
+void bz_stats_buf(struct bz_file *bzf, size_t len) {
+    if (len > bzf->stats.peak) {
+        bzf->stats.peak = len;
+    }
+    BZ_STATS_LOCK();
+    if (len > bz_stats_total.peak) {
+        bz_stats_total.peak = len;
+    }
+    BZ_STATS_UNLOCK();
+}
+
+VALUE bz_stats_hash(struct bz_stats *st) {
+    VALUE res = rb_hash_new();
+
+    rb_hash_aset(res, ID2SYM(rb_intern("bytes_in")), ULL2NUM(st->in));
+    rb_hash_aset(res, ID2SYM(rb_intern("bytes_out")), ULL2NUM(st->out));
+    rb_hash_aset(res, ID2SYM(rb_intern("lib_calls")), ULL2NUM(st->calls));
+    rb_hash_aset(res, ID2SYM(rb_intern("lib_time")), rb_float_new(st->libtime));
+    rb_hash_aset(res, ID2SYM(rb_intern("io_reads")), ULL2NUM(st->reads));
+    rb_hash_aset(res, ID2SYM(rb_intern("io_writes")), ULL2NUM(st->writes));
+    rb_hash_aset(res, ID2SYM(rb_intern("io_time")), rb_float_new(st->iotime));
+    rb_hash_aset(res, ID2SYM(rb_intern("peak_buffer")), SIZET2NUM(st->peak));
+    return res;
+}
+
+/*
+ * call-seq:
+ *    stats -> Hash
+ *
+ * Counters of this stream since it was created, which can be asked for
+ * after it has been closed too:
+ *
+ * [:bytes_in, :bytes_out] the bytes which went into and came out of
+ *                         libbzip2
+ * [:lib_calls] the number of calls to BZ2_bzCompress or BZ2_bzDecompress,
+ *              each block counts as one for the parallel classes
+ * [:lib_time] seconds spent in libbzip2, added up over all threads for the
+ *             parallel classes
+ * [:io_reads, :io_writes] the number of reads from and writes to the io,
+ *                         strings and mapped files are never read from
+ * [:io_time] seconds spent reading from or writing to the io
+ * [:peak_buffer] the largest size the buffer of decompressed or compressed
+ *                data had
+ *
+ * A slow stream with most of its time in :lib_time is busy compressing,
+ * one with most of it in :io_time waits for its io.
+ *
+ *    writer.stats # => {:bytes_in=>1048576, :bytes_out=>52116, ...}
+ *
+ * @return [Hash] the counters
+ */
+VALUE bz_file_stats(VALUE obj) {
+    struct bz_file *bzf;
+
+    Data_Get_BZ2(obj, bzf);
+    return bz_stats_hash(&bzf->stats);
+}
+
+/*
+ * call-seq:
+ *    stats -> Hash
+ *
+ * The counters of Bzip2::Writer#stats and Bzip2::Reader#stats added up over
+ * all streams of the process, including Bzip2.compress and
+ * Bzip2.uncompress. :peak_buffer is the largest buffer of any of them.
+ * Streams of all ractors are counted.
+ *
+ *    Bzip2.stats[:lib_time]
+ *
+ * @return [Hash] the counters
+ */
+VALUE bz_s_stats(VALUE self) {
+    struct bz_stats st;
+
+    BZ_STATS_LOCK();
+    st = bz_stats_total;
+    BZ_STATS_UNLOCK();
+    return bz_stats_hash(&st);
+}
+
+/*
+ * Runs a whole buffer through a stream of its own, like
+ * BZ2_bzBuffToBuffCompress but with the pooled memory. Safe to call without
+ * the GVL.
+ */
+int bz_buff_compress(char *out, unsigned int *outlen, char *in,
+    unsigned int inlen, int blocks, int work) {
+    bz_stream bzs;
+    int state;
+
+    memset(&bzs, 0, sizeof(bzs));
+    bzs.bzalloc = bz_malloc;
+    bzs.bzfree = bz_free;
+    if ((state = BZ2_bzCompressInit(&bzs, blocks, 0, work)) != BZ_OK) {
+        return state;
+    }
+    bzs.next_in = in;
+    bzs.avail_in = inlen;
+    bzs.next_out = out;
+    bzs.avail_out = *outlen;
+    while ((state = BZ2_bzCompress(&bzs, BZ_FINISH)) == BZ_FINISH_OK) {
+        if (!bzs.avail_out) {
+            state = BZ_OUTBUFF_FULL;
+            break;
+        }
+    }
+    *outlen -= bzs.avail_out;
+    BZ2_bzCompressEnd(&bzs);
+    return state == BZ_STREAM_END ? BZ_OK : state;
+}
+
+struct bz_blocking {
+    void *(*func)(void *);
+    void *arg;
+    void (*ubf)(void *);
+    void *ubfarg;
+};
+
+#if !defined(HAVE_RB_THREAD_CALL_WITHOUT_GVL) && defined(HAVE_RB_THREAD_BLOCKING_REGION)
+VALUE bz_blocking_func(void *ptr) {
+    struct bz_blocking *blk = ptr;
+    (*blk->func)(blk->arg);
+    return Qnil;
+}
+#endif
+
+VALUE bz_blocking_i(VALUE ptr) {
+    struct bz_blocking *blk = (struct bz_blocking *)ptr;
+
+#if defined(HAVE_RB_THREAD_CALL_WITHOUT_GVL)
+    rb_thread_call_without_gvl(blk->func, blk->arg, blk->ubf, blk->ubfarg);
+#elif defined(HAVE_RB_THREAD_BLOCKING_REGION)
+    rb_thread_blocking_region(bz_blocking_func, blk, blk->ubf, blk->ubfarg);
+#else
+    (*blk->func)(blk->arg);
+#endif
+    return Qnil;
+}
+
+/*
+ * Runs func(arg) with the GVL released so that other ruby threads can make
+ * progress while libbzip2 is busy. The stream is flagged as busy for the
+ * duration of the call so that it can't be touched from another thread, and
+ * the flag is cleared again before any pending interrupt is re-raised.
+ * bzf may be NULL for work which doesn't belong to any stream object.
+ */
+void bz_blocking_call(struct bz_file *bzf, void *(*func)(void *), void *arg,
+                      void (*ubf)(void *), void *ubfarg) {
+    struct bz_blocking blk;
+    int state = 0;
+
+    blk.func = func;
+    blk.arg = arg;
+    blk.ubf = ubf;
+    blk.ubfarg = ubfarg;
+    if (bzf) {
+        bzf->flags |= BZ2_RB_BUSY;
+    }
+    rb_protect(bz_blocking_i, (VALUE)&blk, &state);
+    if (bzf) {
+        bzf->flags &= ~BZ2_RB_BUSY;
+        bz_mem_report(bzf);
+    }
+    if (state) {
+        rb_jump_tag(state);
+    }
+}
+
+/*
+ * Returns the file descriptor under io if it can be used with read(2) and
+ * write(2) directly: io has to be a File without any data buffered on the
+ * ruby side and without any conversion of the data. Otherwise -1 is
+ * returned and the io has to be called through ruby.
+ *
+ * With rb_io_mode the buffers of the File can't be looked at any more, so
+ * only writes go to the descriptor: the write buffer is flushed first, and
+ * binary mode rules out conversions of the (binary) compressed data.
+ */
+int bz_io_fd(VALUE io, int writing) {
+#if defined(HAVE_RB_IO_MODE) && defined(HAVE_RB_IO_DESCRIPTOR)
+    if (!writing || TYPE(io) != T_FILE) {
+        return -1;
+    }
+    io = rb_io_get_write_io(io);
+    if (!(rb_io_mode(io) & FMODE_BINMODE)) {
+        return -1;
+    }
+    rb_io_flush(io);
+    return rb_io_descriptor(io);
+#elif defined(BZ_FD_IO)
+    rb_io_t *fptr;
+
+    if (TYPE(io) != T_FILE) {
+        return -1;
+    }
+    if (writing) {
+        io = rb_io_get_write_io(io);
+    }
+    GetOpenFile(io, fptr);
+    rb_io_check_closed(fptr);
+    if ((fptr->mode & FMODE_TEXTMODE) || fptr->encs.enc2 || fptr->encs.ecflags) {
+        return -1;
+    }
+    if (writing) {
+        if (BZ_IO_WBUF_LEN(fptr)) {
+            rb_io_flush(io);
+        }
+    } else if (BZ_IO_RBUF_LEN(fptr)) {
+        return -1;
+    }
+    return fptr->fd;
+#else
+    return -1;
+#endif
+}
+
+struct bz_fd_arg {
+    int fd, err;
+    char *ptr;
+    long len, res;
+};
+
+void * bz_fd_read_i(void *ptr) {
+    struct bz_fd_arg *arg = ptr;
+
+    arg->res = (long) read(arg->fd, arg->ptr, arg->len);
+    arg->err = errno;
+    return 0;
+}
+
+void * bz_fd_write_i(void *ptr) {
+    struct bz_fd_arg *arg = ptr;
+
+    arg->res = (long) write(arg->fd, arg->ptr, arg->len);
+    arg->err = errno;
+    return 0;
+}
+
+/*
+ * read(2) without the GVL. Returns the number of bytes read, 0 at the end
+ * of the file, or -1 if the descriptor is non-blocking and has nothing to
+ * offer, in which case the io should be read through ruby.
+ */
+long bz_fd_read(struct bz_file *bzf, int fd, char *ptr, long len) {
+    struct bz_fd_arg arg;
+
+    arg.fd = fd;
+    arg.ptr = ptr;
+    arg.len = len;
+    while (1) {
+        bz_blocking_call(bzf, bz_fd_read_i, &arg, RUBY_UBF_IO, 0);
+        if (arg.res >= 0) {
+            return arg.res;
+        }
+        if (arg.err == EAGAIN || arg.err == EWOULDBLOCK) {
+            return -1;
+        }
+        if (arg.err != EINTR) {
+            errno = arg.err;
+            rb_sys_fail(0);
+        }
+    }
+}
+
+/*
+ * write(2) without the GVL until everything is written. Returns how much
+ * was written, which is less than len only if the descriptor is
+ * non-blocking and full; the rest should be written through ruby.
+ */
+long bz_fd_write(struct bz_file *bzf, int fd, const char *ptr, long len) {
+    struct bz_fd_arg arg;
+    long done = 0;
+
+    arg.fd = fd;
+    while (done < len) {
+        arg.ptr = (char *) ptr + done;
+        arg.len = len - done;
+        bz_blocking_call(bzf, bz_fd_write_i, &arg, RUBY_UBF_IO, 0);
+        if (arg.res >= 0) {
+            done += arg.res;
+        } else if (arg.err == EAGAIN || arg.err == EWOULDBLOCK) {
+            break;
+        } else if (arg.err != EINTR) {
+            errno = arg.err;
+            rb_sys_fail(0);
+        }
+    }
+    return done;
+}
+
+/*
+ * The smallest block size (1-9) which takes size bytes of input in a single
+ * block. The initial run length encoding may grow the input by up to a
+ * quarter, which is allowed for.
+ */
+int bz_auto_blocks(unsigned long size) {
+    unsigned long blocks = (size + size / 4 + 19) / 100000 + 1;
+
+    return blocks > DEFAULT_BLOCKS ? DEFAULT_BLOCKS : (int) blocks;
+}
+
+/*
+ * Allocates the buffer of a stream with room for *len bytes (and a
+ * terminator), reusing the one kept by #reset if it is large enough. *len
+ * is set to the actual length of the buffer.
+ */
+char * bz_buf_alloc(struct bz_file *bzf, unsigned int *len) {
+    char *buf = bzf->spare;
+
+    if (buf) {
+        if (bzf->sparelen >= *len) {
+            *len = bzf->sparelen;
+        } else {
+            free(buf);
+            buf = 0;
+        }
+        bzf->spare = 0;
+        bzf->sparelen = 0;
+    }
+    if (!buf) {
+        buf = ALLOC_N(char, *len + 1);
+    }
+    bz_stats_buf(bzf, *len);
+    return buf;
+}
+
+/*
+ * Done with bzf->buf: it is kept as the spare buffer while the stream is
+ * being reset, and freed (along with any spare one) otherwise.
+ */
+void bz_buf_release(struct bz_file *bzf) {
+    if (bzf->flags & BZ2_RB_RESET) {
+        if (bzf->spare) {
+            free(bzf->spare);
+        }
+        bzf->spare = bzf->buf;
+        bzf->sparelen = bzf->buflen;
+    } else {
+        if (bzf->buf) {
+            free(bzf->buf);
+        }
+        if (bzf->spare) {
+            free(bzf->spare);
+            bzf->spare = 0;
+            bzf->sparelen = 0;
+        }
+    }
+    bzf->buf = 0;
+}
+
+/*
+ * Looks up the symbol +name+ in an options hash, nil if opts is nil
+ */
+VALUE bz_opt(VALUE opts, const char *name) {
+    if (NIL_P(opts)) {
+        return Qnil;
+    }
+    return rb_hash_aref(opts, ID2SYM(rb_intern(name)));
 }
 
 VALUE bz_raise(int error) {
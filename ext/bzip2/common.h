@@ -7,14 +7,45 @@
 #ifndef RUBY_19_COMPATIBILITY
 #  include <rubyio.h>
 #  include <version.h>
+#  include <st.h>
 #else
 #  include <ruby/io.h>
 #endif
 
+#ifdef HAVE_RUBY_THREAD_H
+#  include <ruby/thread.h>
+#endif
+
+#ifdef HAVE_RUBY_RACTOR_H
+#  include <ruby/ractor.h>
+#endif
+
+#if defined(HAVE_RB_IO_T_RBUF)
+#  define BZ_FD_IO 1
+#  define BZ_IO_RBUF_LEN(fptr) ((fptr)->rbuf.len)
+#  define BZ_IO_WBUF_LEN(fptr) ((fptr)->wbuf.len)
+#elif defined(HAVE_RB_IO_T_RBUF_LEN)
+#  define BZ_FD_IO 1
+#  define BZ_IO_RBUF_LEN(fptr) ((fptr)->rbuf_len)
+#  define BZ_IO_WBUF_LEN(fptr) ((fptr)->wbuf_len)
+#endif
+
 #define BZ2_RB_CLOSE    1
 #define BZ2_RB_INTERNAL 2
+#define BZ2_RB_BUSY     4
+#define BZ2_RB_MULTISTREAM 16
+#define BZ2_RB_MAP      32
+#define BZ2_RB_STRING   64
+#define BZ2_RB_RESET    128
 
 #define BZ_RB_BLOCKSIZE 4096
+#define BZ_RB_WRITESIZE (64 * 1024)
+#define BZ_RB_READSIZE (64 * 1024)
+#define BZ_RB_FILE_READSIZE (128 * 1024)
+#define BZ_RB_MAPSIZE (8 * 1024 * 1024)
+#define BZ_RB_STRSIZE (1 << 30)
+#define BZ_RB_ONESHOT_MAX (1 << 30)
+#define BZ_MEM_LIMIT (32 * 1024 * 1024)
 #define DEFAULT_BLOCKS 9
 #define ASIZE (1 << CHAR_BIT)
 
@@ -28,49 +59,126 @@
 #ifndef RARRAY_PTR
 #  define RARRAY_PTR(s) (RARRAY(s)->ptr)
 #endif
+#ifndef SIZET2NUM
+#  define SIZET2NUM(v) ULONG2NUM(v)
+#  define NUM2SIZET(v) NUM2ULONG(v)
+#endif
 #ifndef RARRAY_LEN
 #  define RARRAY_LEN(s) (RARRAY(s)->len)
 #endif
+#ifndef RB_GC_GUARD
+#  define RB_GC_GUARD(v) (*(volatile VALUE *)&(v))
+#endif
+
+struct bz_pwriter;
+struct bz_preader;
+
+struct bz_stats {
+    unsigned long long in, out;     /* bytes into and out of libbzip2 */
+    unsigned long long calls;       /* BZ2_bzCompress/BZ2_bzDecompress */
+    unsigned long long reads, writes;
+    double libtime, iotime;         /* seconds in libbzip2 and in the io */
+    size_t peak;                    /* largest buffer */
+};
 
 struct bz_file {
     bz_stream bzs;
     VALUE in, io;
+    VALUE index;                /* Bzip2::Index to seek with */
     char *buf;
     unsigned int buflen;
+    char *spare;                /* buf kept by #reset for the next stream */
+    unsigned int sparelen;
+    unsigned int iosize;        /* bytes handed to/read from the io at once */
+    size_t mem;                 /* bytes libbzip2 allocated for this stream */
+    size_t memgc;               /* how much of mem the GC was told about */
+    unsigned long long decoded; /* output produced so far, see Reader#pos */
+    unsigned long long written; /* compressed bytes handed to the io */
+    unsigned long streamsize;   /* a new stream every so many bytes written */
+    unsigned long streamlen;    /* bytes written into the current stream */
     int blocks, work, small;
     int flags, lineno, state;
+    struct bz_pwriter *pw;
+    struct bz_preader *pr;
+    struct bz_iv *iv;           /* entry in bz_internal_ios of a writer */
+    struct bz_stats stats;
 };
 
 struct bz_str {
     VALUE str;
-    int pos;
+    long pos;
+};
+
+struct bz_map {
+    char *ptr;
+    size_t len, pos;
+    size_t dropped;             /* pages before this have been given back */
 };
 
 struct bz_iv {
-    VALUE bz2, io;
-    void (*finalize)();
+    VALUE bz2, io;              /* bz2 is Qnil once the writer is collected */
 };
 
+#ifdef HAVE_RB_DATA_TYPE_T_PARENT
+extern const rb_data_type_t bz_file_type;
+#  define Data_Get_BZ2(obj, bzf) \
+    TypedData_Get_Struct(obj, struct bz_file, &bz_file_type, bzf)
+#else
+#  define Data_Get_BZ2(obj, bzf) Data_Get_Struct(obj, struct bz_file, bzf)
+#endif
+
 #define Get_BZ2(obj, bzf)                       \
     rb_io_taint_check(obj);                     \
-    Data_Get_Struct(obj, struct bz_file, bzf);  \
+    Data_Get_BZ2(obj, bzf);                     \
     if (!RTEST(bzf->io)) {                      \
         rb_raise(rb_eIOError, "closed IO");     \
+    }                                           \
+    if (bzf->flags & BZ2_RB_BUSY) {             \
+        rb_raise(rb_eIOError, "stream in use by another thread"); \
     }
 
 #ifndef ASDFasdf
-extern VALUE bz_cWriter, bz_cReader, bz_cInternal;
+extern VALUE bz_cWriter, bz_cReader, bz_cInternal, bz_cInternalMap;
+extern VALUE bz_cParallelWriter, bz_cParallelReader, bz_cIndex;
 extern VALUE bz_eError, bz_eEOZError;
 
-extern VALUE bz_internal_ary;
+extern st_table *bz_internal_ios;
+extern struct bz_stats bz_stats_total;
 
 extern ID id_new, id_write, id_open, id_flush, id_read;
-extern ID id_closed, id_close, id_str;
+extern ID id_closed, id_close, id_str, id_initialize;
 #endif
 
 void bz_file_mark(struct bz_file * bzf);
+size_t bz_file_memsize(const void *ptr);
+void bz_mem_report(struct bz_file *bzf);
 void* bz_malloc(void *opaque, int m, int n);
 void bz_free(void *opaque, void *p);
+size_t bz_mem_trim(size_t keep);
+int bz_buff_compress(char *out, unsigned int *outlen, char *in,
+    unsigned int inlen, int blocks, int work);
+VALUE bz_s_pool_limit(VALUE self);
+VALUE bz_s_set_pool_limit(VALUE self, VALUE limit);
+VALUE bz_s_pool_size(VALUE self);
+VALUE bz_s_pool_trim(VALUE self);
+void bz_main_ractor_init(void);
+int bz_main_ractor_p(void);
+double bz_now(void);
+void bz_stats_lib(struct bz_file *bzf, unsigned long calls,
+    unsigned long long in, unsigned long long out, double time);
+void bz_stats_io(struct bz_file *bzf, int writing, double since);
+void bz_stats_buf(struct bz_file *bzf, size_t len);
+VALUE bz_file_stats(VALUE obj);
+VALUE bz_s_stats(VALUE self);
 VALUE bz_raise(int err);
+VALUE bz_opt(VALUE opts, const char *name);
+char * bz_buf_alloc(struct bz_file *bzf, unsigned int *len);
+void bz_buf_release(struct bz_file *bzf);
+int bz_auto_blocks(unsigned long size);
+void bz_blocking_call(struct bz_file *bzf, void *(*func)(void *), void *arg,
+    void (*ubf)(void *), void *ubfarg);
+int bz_io_fd(VALUE io, int writing);
+long bz_fd_read(struct bz_file *bzf, int fd, char *ptr, long len);
+long bz_fd_write(struct bz_file *bzf, int fd, const char *ptr, long len);
 
 #endif
@@ -14,6 +14,50 @@ if have_library("bz2", "BZ2_bzWriteOpen")
   if RUBY_VERSION.to_f >= 1.9
     $CFLAGS << ' -DRUBY_19_COMPATIBILITY'
   end
+
+  # releasing the GVL around libbzip2
+  have_header('ruby/thread.h')
+  have_func('rb_thread_call_without_gvl', 'ruby/thread.h')
+  have_func('rb_thread_blocking_region')
+
+  # native thread pool for Bzip2::ParallelWriter
+  if have_header('pthread.h')
+    have_library('pthread', 'pthread_create')
+  end
+
+  # Bzip2::Reader.mmap
+  if have_header('sys/mman.h') && have_func('mmap', 'sys/mman.h')
+    have_func('madvise', 'sys/mman.h')
+  end
+
+  # Reader/Writer as typed data which report their memory to the GC
+  have_struct_member('rb_data_type_t', 'parent', 'ruby.h')
+  have_func('rb_gc_adjust_memory_usage', 'ruby.h')
+  # and move with compaction
+  have_func('rb_gc_location', 'ruby.h')
+
+  # usable from any Ractor
+  have_func('rb_ext_ractor_safe', 'ruby.h')
+  have_header('ruby/ractor.h') &&
+    have_func('rb_ractor_local_storage_value_newkey', 'ruby/ractor.h')
+
+  # USDT probes, see probes.h
+  have_header('sys/sdt.h')
+
+  # Bzip2.stats
+  unless have_func('clock_gettime', 'time.h')
+    have_library('rt', 'clock_gettime') && have_func('clock_gettime', 'time.h')
+  end
+
+  # read(2)/write(2) straight on the descriptor of a File. The buffers of
+  # rb_io_t are deprecated along with the rest of it once rb_io_mode is
+  # there, which leaves only writes (see bz_io_fd)
+  if RUBY_VERSION.to_f >= 1.9
+    have_func('rb_io_descriptor', 'ruby/io.h')
+    have_func('rb_io_mode', 'ruby/io.h') or
+      have_struct_member('rb_io_t', 'rbuf', 'ruby/io.h') or
+      have_struct_member('rb_io_t', 'rbuf_len', 'ruby/io.h')
+  end
   
   create_makefile('bzip2/bzip2')
 else
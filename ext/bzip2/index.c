@@ -0,0 +1,293 @@
+#include <ruby.h>
+#include <bzlib.h>
+#include <string.h>
+#include "common.h"
+#include "reader.h"
+#include "parallel.h"
+#include "index.h"
+
+void bz_index_free(struct bz_index *idx) {
+    if (idx->ents) {
+        xfree(idx->ents);
+    }
+    xfree(idx);
+}
+
+size_t bz_index_memsize(const void *ptr) {
+    const struct bz_index *idx = ptr;
+
+    return sizeof(struct bz_index) + idx->capa * sizeof(struct bz_index_entry);
+}
+
+#ifdef HAVE_RB_DATA_TYPE_T_PARENT
+const rb_data_type_t bz_index_type = {
+    "Bzip2::Index",
+    {0, (RUBY_DATA_FUNC)bz_index_free, bz_index_memsize},
+    0, 0,
+#ifdef RUBY_TYPED_FREE_IMMEDIATELY
+    RUBY_TYPED_FREE_IMMEDIATELY
+#endif
+};
+#endif
+
+/*
+ * Internally allocates an empty index
+ * @private
+ */
+VALUE bz_index_s_alloc(VALUE klass) {
+    struct bz_index *idx;
+
+#ifdef HAVE_RB_DATA_TYPE_T_PARENT
+    return TypedData_Make_Struct(klass, struct bz_index, &bz_index_type, idx);
+#else
+    return Data_Make_Struct(klass, struct bz_index, 0, bz_index_free, idx);
+#endif
+}
+
+struct bz_index * bz_index_get(VALUE obj) {
+    struct bz_index *idx;
+
+#ifdef HAVE_RB_DATA_TYPE_T_PARENT
+    TypedData_Get_Struct(obj, struct bz_index, &bz_index_type, idx);
+#else
+    if (!rb_obj_is_kind_of(obj, bz_cIndex)) {
+        rb_raise(rb_eTypeError, "expected a Bzip2::Index");
+    }
+    Data_Get_Struct(obj, struct bz_index, idx);
+#endif
+    return idx;
+}
+
+void bz_index_push(struct bz_index *idx, unsigned long long bit) {
+    struct bz_index_entry *ent;
+
+    if (idx->len == idx->capa) {
+        idx->capa = idx->capa ? idx->capa * 2 : 64;
+        REALLOC_N(idx->ents, struct bz_index_entry, idx->capa);
+    }
+    ent = &idx->ents[idx->len++];
+    ent->bit = bit;
+    ent->offset = idx->size;
+    ent->line = idx->lines;
+}
+
+/*
+ * Accounts for len more bytes of decompressed data in the last block
+ */
+void bz_index_add(struct bz_index *idx, const char *ptr, unsigned long len) {
+    const char *end = ptr + len;
+
+    idx->size += len;
+    while ((ptr = memchr(ptr, '\n', end - ptr))) {
+        idx->lines++;
+        ptr++;
+    }
+}
+
+/*
+ * The last block starting at or before offset, -1 if there are no blocks
+ */
+long bz_index_find(struct bz_index *idx, unsigned long long offset) {
+    long lo = 0, hi = idx->len - 1, mid;
+
+    if (!idx->len) {
+        return -1;
+    }
+    while (lo < hi) {
+        mid = lo + (hi - lo + 1) / 2;
+        if (idx->ents[mid].offset <= offset) {
+            lo = mid;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    return lo;
+}
+
+/*
+ * The block which holds the start of line (counting from 0): the last one
+ * with fewer lines before it, -1 if there are no blocks
+ */
+long bz_index_find_line(struct bz_index *idx, unsigned long long line) {
+    long lo = 0, hi = idx->len - 1, mid;
+
+    if (!idx->len) {
+        return -1;
+    }
+    while (lo < hi) {
+        mid = lo + (hi - lo + 1) / 2;
+        if (idx->ents[mid].line < line) {
+            lo = mid;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    return lo;
+}
+
+struct bz_index_arg {
+    VALUE reader;
+    struct bz_index *idx;
+};
+
+VALUE bz_index_build_i(VALUE ptr) {
+    struct bz_index_arg *arg = (struct bz_index_arg *) ptr;
+    struct bz_index *idx = arg->idx;
+    struct bz_file *bzf;
+    struct bz_job *job;
+
+    Data_Get_BZ2(arg->reader, bzf);
+    while ((job = bz_preader_front(bzf))) {
+        bz_index_push(idx, job->bit);
+        bz_index_add(idx, job->out, job->outlen);
+        bz_preader_pop(bzf);
+    }
+    return Qnil;
+}
+
+/*
+ * call-seq:
+ *    build(io, options = {})
+ *
+ * Decompresses all of +io+ once, recording where each block starts in the
+ * compressed input along with how many bytes and lines of output come
+ * before it. Concatenated streams are indexed as a whole. The blocks are
+ * decompressed in parallel, like with a Bzip2::ParallelReader.
+ *
+ *    index = Bzip2::Index.build File.open('file.bz2', 'rb')
+ *    File.open('file.bz2.idx', 'wb') { |f| f << index.dump }
+ *
+ * @param [File, String, #read] io the compressed data
+ * @param [Hash] options see Bzip2::ParallelReader#initialize
+ * @return [Bzip2::Index] the index of +io+
+ */
+VALUE bz_index_s_build(int argc, VALUE *argv, VALUE klass) {
+    struct bz_index_arg arg;
+    VALUE res;
+
+    res = bz_index_s_alloc(klass);
+    arg.idx = bz_index_get(res);
+    arg.reader = rb_funcall2(bz_cParallelReader, id_new, argc, argv);
+    rb_ensure(bz_index_build_i, (VALUE) &arg, bz_reader_close, arg.reader);
+    return res;
+}
+
+/*
+ * @return [Integer] the number of bytes of decompressed data
+ */
+VALUE bz_index_size(VALUE obj) {
+    return ULL2NUM(bz_index_get(obj)->size);
+}
+
+/*
+ * @return [Integer] the number of lines (newlines) in the decompressed data
+ */
+VALUE bz_index_lines(VALUE obj) {
+    return ULL2NUM(bz_index_get(obj)->lines);
+}
+
+/*
+ * @return [Integer] the number of blocks which were found
+ */
+VALUE bz_index_blocks(VALUE obj) {
+    return LONG2NUM(bz_index_get(obj)->len);
+}
+
+void bz_index_put64(char *p, unsigned long long v) {
+    int i;
+
+    for (i = 7; i >= 0; i--) {
+        p[i] = (char) (v & 0xff);
+        v >>= 8;
+    }
+}
+
+unsigned long long bz_index_get64(const char *p) {
+    unsigned long long v = 0;
+    int i;
+
+    for (i = 0; i < 8; i++) {
+        v = (v << 8) | (unsigned char) p[i];
+    }
+    return v;
+}
+
+/*
+ * call-seq:
+ *    dump -> String
+ *
+ * Serializes the index for a sidecar file, to be read back with
+ * Bzip2::Index.load. Marshal works too.
+ *
+ * @return [String] the index as a binary string
+ */
+VALUE bz_index_dump(VALUE obj) {
+    struct bz_index *idx = bz_index_get(obj);
+    VALUE res;
+    char *p;
+    long i;
+
+    res = rb_str_new(0, BZ_INDEX_HEADER + idx->len * BZ_INDEX_ENTRY);
+    p = RSTRING_PTR(res);
+    memcpy(p, BZ_INDEX_MAGIC, 4);
+    bz_index_put64(p + 4, idx->len);
+    bz_index_put64(p + 12, idx->size);
+    bz_index_put64(p + 20, idx->lines);
+    p += BZ_INDEX_HEADER;
+    for (i = 0; i < idx->len; i++, p += BZ_INDEX_ENTRY) {
+        bz_index_put64(p, idx->ents[i].bit);
+        bz_index_put64(p + 8, idx->ents[i].offset);
+        bz_index_put64(p + 16, idx->ents[i].line);
+    }
+    return res;
+}
+
+VALUE bz_index_marshal_dump(VALUE obj, VALUE level) {
+    return bz_index_dump(obj);
+}
+
+/*
+ * call-seq:
+ *    load(data) -> Bzip2::Index
+ *
+ *    index = Bzip2::Index.load File.open('file.bz2.idx', 'rb') { |f| f.read }
+ *    reader = Bzip2::Reader.open('file.bz2', :index => index)
+ *
+ * @param [String] data what Bzip2::Index#dump returned
+ * @return [Bzip2::Index] the index
+ * @raise [ArgumentError] if +data+ isn't a dumped index
+ */
+VALUE bz_index_s_load(VALUE klass, VALUE data) {
+    struct bz_index *idx;
+    const char *p;
+    unsigned long long len;
+    VALUE res;
+    long i;
+
+    StringValue(data);
+    p = RSTRING_PTR(data);
+    if (RSTRING_LEN(data) < BZ_INDEX_HEADER || memcmp(p, BZ_INDEX_MAGIC, 4)) {
+        rb_raise(rb_eArgError, "invalid index");
+    }
+    len = bz_index_get64(p + 4);
+    if (len != (unsigned long long) (RSTRING_LEN(data) - BZ_INDEX_HEADER) /
+        BZ_INDEX_ENTRY || (RSTRING_LEN(data) - BZ_INDEX_HEADER) % BZ_INDEX_ENTRY) {
+        rb_raise(rb_eArgError, "invalid index");
+    }
+    res = bz_index_s_alloc(klass);
+    idx = bz_index_get(res);
+    if (len) {
+        idx->ents = ALLOC_N(struct bz_index_entry, len);
+        idx->capa = (long) len;
+    }
+    idx->size = bz_index_get64(p + 12);
+    idx->lines = bz_index_get64(p + 20);
+    p += BZ_INDEX_HEADER;
+    for (i = 0; i < (long) len; i++, p += BZ_INDEX_ENTRY) {
+        idx->ents[i].bit = bz_index_get64(p);
+        idx->ents[i].offset = bz_index_get64(p + 8);
+        idx->ents[i].line = bz_index_get64(p + 16);
+    }
+    idx->len = (long) len;
+    return res;
+}
@@ -0,0 +1,41 @@
+#ifndef _RB_BZIP2_INDEX_H_
+#define _RB_BZIP2_INDEX_H_
+
+#include <ruby.h>
+#include "common.h"
+
+struct bz_index_entry {
+    unsigned long long bit;     /* block magic in the compressed input */
+    unsigned long long offset;  /* decompressed bytes before the block */
+    unsigned long long line;    /* lines before the block */
+};
+
+struct bz_index {
+    struct bz_index_entry *ents;
+    long len, capa;
+    unsigned long long size, lines;
+};
+
+#define BZ_INDEX_MAGIC "BZix"
+#define BZ_INDEX_HEADER (4 + 3 * 8)
+#define BZ_INDEX_ENTRY  (3 * 8)
+
+struct bz_index * bz_index_get(VALUE obj);
+void bz_index_push(struct bz_index *idx, unsigned long long bit);
+void bz_index_add(struct bz_index *idx, const char *ptr, unsigned long len);
+long bz_index_find(struct bz_index *idx, unsigned long long offset);
+long bz_index_find_line(struct bz_index *idx, unsigned long long line);
+
+/* Instance methods */
+VALUE bz_index_size(VALUE obj);
+VALUE bz_index_lines(VALUE obj);
+VALUE bz_index_blocks(VALUE obj);
+VALUE bz_index_dump(VALUE obj);
+VALUE bz_index_marshal_dump(VALUE obj, VALUE level);
+
+/* Class methods */
+VALUE bz_index_s_alloc(VALUE klass);
+VALUE bz_index_s_build(int argc, VALUE *argv, VALUE klass);
+VALUE bz_index_s_load(VALUE klass, VALUE data);
+
+#endif
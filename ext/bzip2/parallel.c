@@ -0,0 +1,1012 @@
+#include <ruby.h>
+#include <bzlib.h>
+#include <unistd.h>
+#include <signal.h>
+
+#include "common.h"
+#include "writer.h"
+#include "reader.h"
+#include "parallel.h"
+#include "index.h"
+#include "probes.h"
+
+#ifdef HAVE_PTHREAD_H
+#  define BZ_POOL_LOCK(pool)   pthread_mutex_lock(&(pool)->lock)
+#  define BZ_POOL_UNLOCK(pool) pthread_mutex_unlock(&(pool)->lock)
+#else
+#  define BZ_POOL_LOCK(pool)
+#  define BZ_POOL_UNLOCK(pool)
+#endif
+
+int bz_cpu_count(void) {
+#ifdef _SC_NPROCESSORS_ONLN
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    if (n > 0) {
+        return (int) n;
+    }
+#endif
+    return 1;
+}
+
+/*
+ * Job buffers come from plain malloc as the worker threads allocate and
+ * resize them without holding the GVL.
+ */
+void * bz_job_malloc(size_t size) {
+    void *ptr = malloc(size);
+
+    if (!ptr) {
+        rb_memerror();
+    }
+    return ptr;
+}
+
+void bz_job_free(struct bz_job *job) {
+    if (job->in) {
+        free(job->in);
+    }
+    if (job->out) {
+        free(job->out);
+    }
+    xfree(job);
+}
+
+#ifdef HAVE_PTHREAD_H
+/*
+ * Body of the native worker threads. They never touch any ruby object and
+ * only pick jobs off the queue, run them and flag them as done.
+ */
+void * bz_pool_worker(void *ptr) {
+    struct bz_pool *pool = ptr;
+    struct bz_job *job;
+
+    pthread_mutex_lock(&pool->lock);
+    while (1) {
+        while (!pool->head && !pool->shutdown) {
+            pthread_cond_wait(&pool->wake, &pool->lock);
+        }
+        if (pool->shutdown) {
+            break;
+        }
+        job = pool->head;
+        pool->head = job->next;
+        if (!pool->head) {
+            pool->tail = 0;
+        }
+        pthread_mutex_unlock(&pool->lock);
+        (*job->run)(job);
+        pthread_mutex_lock(&pool->lock);
+        job->done = 1;
+        pthread_cond_broadcast(&pool->done);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return 0;
+}
+#endif
+
+/*
+ * Creates a pool of nthreads native threads. If threads aren't available
+ * (or can't be created) the pool has no threads at all and jobs are run by
+ * whoever waits on them.
+ */
+struct bz_pool * bz_pool_new(int nthreads) {
+    struct bz_pool *pool = ALLOC(struct bz_pool);
+
+    MEMZERO(pool, struct bz_pool, 1);
+#ifdef HAVE_PTHREAD_H
+    {
+        sigset_t all, old;
+        int i;
+
+        pthread_mutex_init(&pool->lock, 0);
+        pthread_cond_init(&pool->wake, 0);
+        pthread_cond_init(&pool->done, 0);
+        pool->threads = ALLOC_N(pthread_t, nthreads);
+        /* signals are for the ruby threads to handle */
+        sigfillset(&all);
+        pthread_sigmask(SIG_SETMASK, &all, &old);
+        for (i = 0; i < nthreads; i++) {
+            if (pthread_create(&pool->threads[i], 0, bz_pool_worker, pool)) {
+                break;
+            }
+        }
+        pthread_sigmask(SIG_SETMASK, &old, 0);
+        pool->nthreads = i;
+    }
+#endif
+    return pool;
+}
+
+void bz_pool_submit(struct bz_pool *pool, struct bz_job *job) {
+    job->next = 0;
+    job->done = 0;
+    BZ_POOL_LOCK(pool);
+    if (pool->tail) {
+        pool->tail->next = job;
+    } else {
+        pool->head = job;
+    }
+    pool->tail = job;
+#ifdef HAVE_PTHREAD_H
+    pthread_cond_signal(&pool->wake);
+#endif
+    BZ_POOL_UNLOCK(pool);
+}
+
+int bz_pool_done(struct bz_pool *pool, struct bz_job *job) {
+    int done;
+
+    BZ_POOL_LOCK(pool);
+    done = job->done;
+    BZ_POOL_UNLOCK(pool);
+    return done;
+}
+
+struct bz_pool_wait_arg {
+    struct bz_pool *pool;
+    struct bz_job *job;
+    int done;
+};
+
+void * bz_pool_wait_i(void *ptr) {
+    struct bz_pool_wait_arg *arg = ptr;
+
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_lock(&arg->pool->lock);
+    while (!arg->job->done && !arg->pool->interrupted) {
+        pthread_cond_wait(&arg->pool->done, &arg->pool->lock);
+    }
+    arg->done = arg->job->done;
+    pthread_mutex_unlock(&arg->pool->lock);
+#endif
+    return 0;
+}
+
+void bz_pool_wait_ubf(void *ptr) {
+#ifdef HAVE_PTHREAD_H
+    struct bz_pool_wait_arg *arg = ptr;
+
+    pthread_mutex_lock(&arg->pool->lock);
+    arg->pool->interrupted = 1;
+    pthread_cond_broadcast(&arg->pool->done);
+    pthread_mutex_unlock(&arg->pool->lock);
+#endif
+}
+
+void * bz_pool_run_i(void *ptr) {
+    struct bz_job *job = ptr;
+
+    (*job->run)(job);
+    return 0;
+}
+
+/*
+ * Blocks (without the GVL) until job has been run. A pool without threads
+ * runs the job right here instead.
+ */
+void bz_pool_wait(struct bz_file *bzf, struct bz_pool *pool, struct bz_job *job) {
+    struct bz_pool_wait_arg arg;
+
+    if (!pool->nthreads) {
+        if (!job->done) {
+            bz_blocking_call(bzf, bz_pool_run_i, job, 0, 0);
+            pool->head = pool->head->next;
+            if (!pool->head) {
+                pool->tail = 0;
+            }
+            job->done = 1;
+        }
+        return;
+    }
+    arg.pool = pool;
+    arg.job = job;
+    arg.done = 0;
+    while (!arg.done) {
+        BZ_POOL_LOCK(pool);
+        pool->interrupted = 0;
+        BZ_POOL_UNLOCK(pool);
+        bz_blocking_call(bzf, bz_pool_wait_i, &arg, bz_pool_wait_ubf, &arg);
+    }
+}
+
+/*
+ * Stops and joins all threads of the pool. Jobs still sitting in the queue
+ * are left alone, they belong to whoever submitted them.
+ */
+void bz_pool_free(struct bz_pool *pool) {
+#ifdef HAVE_PTHREAD_H
+    int i;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->shutdown = 1;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+    for (i = 0; i < pool->nthreads; i++) {
+        pthread_join(pool->threads[i], 0);
+    }
+    xfree(pool->threads);
+    pthread_cond_destroy(&pool->done);
+    pthread_cond_destroy(&pool->wake);
+    pthread_mutex_destroy(&pool->lock);
+#endif
+    xfree(pool);
+}
+
+/*
+ * Called on a worker thread: every chunk becomes a complete bzip2 stream of
+ * its own.
+ */
+void bz_pwriter_run(struct bz_job *job) {
+    double start = bz_now();
+
+    job->outlen = job->outsize;
+    job->state = bz_buff_compress(job->out, &job->outlen, job->in,
+        job->inlen, job->blocks, job->work);
+    job->time = bz_now() - start;
+}
+
+/*
+ * Writes out the finished chunks at the front of the queue, in order. With
+ * +all+ set this waits for every chunk, otherwise it only waits while more
+ * than the configured amount of memory is tied up in chunks.
+ */
+void bz_pwriter_drain(struct bz_file *bzf, int all) {
+    struct bz_pwriter *pw = bzf->pw;
+    struct bz_job *job;
+    VALUE str = Qnil;
+    double start;
+    int state;
+
+    while ((job = pw->first)) {
+        if (!all && pw->inflight <= pw->memory && !bz_pool_done(pw->pool, job)) {
+            break;
+        }
+        bz_pool_wait(bzf, pw->pool, job);
+        pw->first = job->order;
+        if (!pw->first) {
+            pw->last = 0;
+        }
+        pw->inflight -= job->inlen + job->outsize;
+        state = job->state;
+        if (state == BZ_OK && !NIL_P(bzf->index)) {
+            /* every chunk is a stream, its first block follows the header */
+            bz_index_push(bz_index_get(bzf->index), bzf->written * 8 + 32);
+            bz_index_add(bz_index_get(bzf->index), job->in, job->inlen);
+        }
+        if (state == BZ_OK) {
+            BZ_PROBE2(stream__end, job->inlen, job->outlen);
+            bz_stats_lib(bzf, 1, job->inlen, job->outlen, job->time);
+            bzf->written += job->outlen;
+            if (bzf->flags & BZ2_RB_INTERNAL) {
+                rb_str_cat(bzf->io, job->out, job->outlen);
+            } else {
+                str = rb_str_new(job->out, job->outlen);
+            }
+        }
+        bz_job_free(job);
+        if (state != BZ_OK) {
+            bz_raise(state);
+        }
+        if (!NIL_P(str)) {
+            BZ_PROBE1(io__write__start, RSTRING_LEN(str));
+            start = bz_now();
+            rb_funcall(bzf->io, id_write, 1, str);
+            bz_stats_io(bzf, 1, start);
+            BZ_PROBE1(io__write__done, RSTRING_LEN(str));
+            str = Qnil;
+        }
+    }
+}
+
+/*
+ * Hands the current chunk over to the thread pool
+ */
+void bz_pwriter_submit(struct bz_file *bzf) {
+    struct bz_pwriter *pw = bzf->pw;
+    struct bz_job *job;
+
+    job = ALLOC(struct bz_job);
+    MEMZERO(job, struct bz_job, 1);
+    job->run = bz_pwriter_run;
+    job->in = pw->chunk;
+    job->inlen = pw->chunklen;
+    job->outsize = job->inlen + job->inlen / 100 + 600;
+    job->out = bz_job_malloc(job->outsize);
+    job->blocks = bzf->blocks;
+    job->work = bzf->work;
+    pw->chunk = 0;
+    pw->chunklen = 0;
+    if (pw->last) {
+        pw->last->order = job;
+    } else {
+        pw->first = job;
+    }
+    pw->last = job;
+    pw->inflight += job->inlen + job->outsize;
+    if (!pw->pool) {
+        pw->pool = bz_pool_new(pw->threads);
+    }
+    bz_pool_submit(pw->pool, job);
+    bz_pwriter_drain(bzf, 0);
+}
+
+VALUE bz_pwriter_write(struct bz_file *bzf, VALUE str) {
+    struct bz_pwriter *pw = bzf->pw;
+    const char *ptr = RSTRING_PTR(str);
+    long len = RSTRING_LEN(str);
+    unsigned int n;
+
+    while (len > 0) {
+        if (!pw->chunk) {
+            pw->chunk = bz_job_malloc(pw->chunksize);
+            pw->chunklen = 0;
+        }
+        n = pw->chunksize - pw->chunklen;
+        if (len < n) {
+            n = (unsigned int) len;
+        }
+        MEMCPY(pw->chunk + pw->chunklen, ptr, char, n);
+        pw->chunklen += n;
+        ptr += n;
+        len -= n;
+        if (pw->chunklen == pw->chunksize) {
+            bz_pwriter_submit(bzf);
+        }
+    }
+    return INT2NUM(RSTRING_LEN(str));
+}
+
+/*
+ * Drops all threads, chunks and buffers, keeping only the configuration
+ */
+void bz_pwriter_release(struct bz_pwriter *pw) {
+    struct bz_job *job;
+
+    if (pw->pool) {
+        bz_pool_free(pw->pool);
+        pw->pool = 0;
+    }
+    while ((job = pw->first)) {
+        pw->first = job->order;
+        bz_job_free(job);
+    }
+    pw->last = 0;
+    pw->inflight = 0;
+    if (pw->chunk) {
+        free(pw->chunk);
+        pw->chunk = 0;
+        pw->chunklen = 0;
+    }
+}
+
+/*
+ * Compresses whatever is left and writes all streams out, unless the
+ * underlying io has already been closed.
+ */
+void bz_pwriter_flush(struct bz_file *bzf, int closed) {
+    struct bz_pwriter *pw = bzf->pw;
+
+    if (!closed && (pw->first || pw->chunklen)) {
+        if (pw->chunklen) {
+            bz_pwriter_submit(bzf);
+        }
+        bz_pwriter_drain(bzf, 1);
+        if (rb_respond_to(bzf->io, id_flush)) {
+            rb_funcall2(bzf->io, id_flush, 0, 0);
+        }
+    }
+    bz_pwriter_release(pw);
+}
+
+void bz_pwriter_free(struct bz_pwriter *pw) {
+    bz_pwriter_release(pw);
+    xfree(pw);
+}
+
+/*
+ * call-seq:
+ *    initialize(io = nil, options = {})
+ *
+ * Creates a new Bzip2::ParallelWriter. It behaves just like a
+ * Bzip2::Writer, but the data written to it is cut into chunks of
+ * <tt>blocks * 100k</tt> which are compressed on a pool of native threads.
+ * Each chunk becomes a bzip2 stream of its own, and the streams are written
+ * to +io+ in order, so the result is a concatenated .bz2 file which can be
+ * read by +bzip2+, +pbzip2+ and friends.
+ *
+ *    writer = Bzip2::ParallelWriter.new File.open('file.bz2', 'wb'), :threads => 4
+ *    writer << data
+ *    writer.close
+ *
+ * @param [File, #write] io the object compressed data is written to, see
+ *    Bzip2::Writer#initialize
+ * @param [Hash] options
+ * @option options [Integer] :threads (number of processors) the number of
+ *    threads compressing chunks
+ * @option options [Integer] :blocks (9) the block size (1-9) of each chunk
+ * @option options [Integer] :work (0) the work factor of each chunk
+ * @option options [Integer] :memory (two chunks per thread) the number of
+ *    bytes that may be tied up in chunks which haven't been written yet.
+ *    Writes block when more than that is in flight.
+ * @option options [Boolean] :index (false) records where each chunk starts
+ *    in Bzip2::Writer#index
+ */
+VALUE bz_pwriter_init(int argc, VALUE *argv, VALUE obj) {
+    struct bz_file *bzf;
+    struct bz_pwriter *pw;
+    VALUE io, opts, v;
+    int threads, blocks, work;
+    long memory;
+    size_t chunk;
+
+    rb_scan_args(argc, argv, "02", &io, &opts);
+    if (!NIL_P(opts)) {
+        Check_Type(opts, T_HASH);
+    }
+    threads = bz_cpu_count();
+    if (!NIL_P(v = bz_opt(opts, "threads"))) {
+        threads = NUM2INT(v);
+        if (threads < 1) {
+            rb_raise(rb_eArgError, "invalid number of threads %d", threads);
+        }
+    }
+    blocks = DEFAULT_BLOCKS;
+    if (!NIL_P(v = bz_opt(opts, "blocks"))) {
+        blocks = NUM2INT(v);
+        if (blocks < 1 || blocks > 9) {
+            rb_raise(rb_eArgError, "invalid block size %d", blocks);
+        }
+    }
+    work = 0;
+    if (!NIL_P(v = bz_opt(opts, "work"))) {
+        work = NUM2INT(v);
+    }
+    memory = 0;
+    if (!NIL_P(v = bz_opt(opts, "memory"))) {
+        memory = NUM2LONG(v);
+        if (memory < 1) {
+            rb_raise(rb_eArgError, "invalid memory limit %ld", memory);
+        }
+    }
+
+    bz_writer_init(NIL_P(io) ? 0 : 1, &io, obj);
+    Data_Get_BZ2(obj, bzf);
+    bzf->blocks = blocks;
+    bzf->work = work;
+    if (!bzf->pw) {
+        bzf->pw = ALLOC(struct bz_pwriter);
+        MEMZERO(bzf->pw, struct bz_pwriter, 1);
+    }
+    pw = bzf->pw;
+    pw->threads = threads;
+    pw->chunksize = blocks * 100000;
+    chunk = pw->chunksize + pw->chunksize / 100 + 600 + pw->chunksize;
+    pw->memory = memory ? (size_t) memory : chunk * 2 * threads;
+    bz_writer_index_opt(bzf, bz_opt(opts, "index"));
+    return obj;
+}
+
+#define BZ_BLOCK_MAGIC 0x314159265359ULL
+#define BZ_EOS_MAGIC   0x177245385090ULL
+#define BZ_MAGIC_MASK  0xffffffffffffULL
+
+/*
+ * The most a block can take up compressed: 900k symbols of up to 20 bits,
+ * the selectors, the code tables and the headers.
+ */
+#define BZ_BLOCK_MAXBITS \
+    ((size_t) 900000 * 20 + 18002 * 6 + 6 * 258 * 41 + 1024)
+
+#define BZ_SEGMENT_BLOCK   1
+#define BZ_SEGMENT_TRAILER 2
+
+static const unsigned char bz_stream_head[] = { 'B', 'Z', 'h', '9' };
+static const unsigned char bz_stream_tail[] = {
+    0x17, 0x72, 0x45, 0x38, 0x50, 0x90
+};
+
+struct bz_bits {
+    unsigned char *buf;
+    size_t len;                 /* in bits */
+    size_t size;                /* in bytes */
+};
+
+unsigned int bz_bits_get(const unsigned char *src, size_t off, int n) {
+    unsigned int res = 0;
+
+    while (n--) {
+        res = (res << 1) | ((src[off >> 3] >> (7 - (off & 7))) & 1);
+        off++;
+    }
+    return res;
+}
+
+/*
+ * Appends nbits bits of src, starting at bit off, to w. Used by the worker
+ * threads, so it reports failure instead of raising.
+ */
+int bz_bits_put(struct bz_bits *w, const unsigned char *src, size_t off,
+    size_t nbits) {
+    size_t need = (w->len + nbits + 7) / 8;
+    unsigned char *buf;
+
+    if (need > w->size) {
+        size_t size = w->size ? w->size : 64;
+
+        while (size < need) {
+            size *= 2;
+        }
+        if (!(buf = realloc(w->buf, size))) {
+            return 0;
+        }
+        w->buf = buf;
+        w->size = size;
+    }
+    while (nbits) {
+        unsigned int n = 8 - (w->len & 7), bits;
+
+        if (n > nbits) {
+            n = (unsigned int) nbits;
+        }
+        bits = bz_bits_get(src, off, n);
+        if (!(w->len & 7)) {
+            w->buf[w->len >> 3] = 0;
+        }
+        w->buf[w->len >> 3] |= bits << (8 - (w->len & 7) - n);
+        w->len += n;
+        off += n;
+        nbits -= n;
+    }
+    return 1;
+}
+
+/*
+ * Called on a worker thread: decodes a single block by wrapping it into a
+ * stream of its own. The stream CRC of a single block stream is just the
+ * CRC of that block, which sits right after the block magic.
+ */
+void bz_preader_run(struct bz_job *job) {
+    struct bz_bits bits = { 0, 0, 0 };
+    unsigned char crc[4];
+    bz_stream bzs;
+    char *out;
+    int i, state;
+    double start = bz_now();
+
+    job->outlen = 0;
+    job->state = BZ_DATA_ERROR;
+    if (job->nbits < 48 + 32) {
+        return;
+    }
+    for (i = 0; i < 4; i++) {
+        crc[i] = bz_bits_get((unsigned char *) job->in, job->inbit + 48 + i * 8, 8);
+    }
+    if (!bz_bits_put(&bits, bz_stream_head, 0, 32) ||
+        !bz_bits_put(&bits, (unsigned char *) job->in, job->inbit, job->nbits) ||
+        !bz_bits_put(&bits, bz_stream_tail, 0, 48) ||
+        !bz_bits_put(&bits, crc, 0, 32)) {
+        job->state = BZ_MEM_ERROR;
+        free(bits.buf);
+        return;
+    }
+    memset(&bzs, 0, sizeof(bzs));
+    bzs.bzalloc = bz_malloc;
+    bzs.bzfree = bz_free;
+    if ((state = BZ2_bzDecompressInit(&bzs, 0, 0)) != BZ_OK) {
+        job->state = state;
+        free(bits.buf);
+        return;
+    }
+    bzs.next_in = (char *) bits.buf;
+    bzs.avail_in = (unsigned int) ((bits.len + 7) / 8);
+    if (!job->out) {
+        job->outsize = 1024 * 1024;
+        if (!(job->out = malloc(job->outsize))) {
+            job->state = BZ_MEM_ERROR;
+        }
+    }
+    while (job->out) {
+        bzs.next_out = job->out + job->outlen;
+        bzs.avail_out = job->outsize - job->outlen;
+        state = BZ2_bzDecompress(&bzs);
+        job->outlen = job->outsize - bzs.avail_out;
+        if (state == BZ_STREAM_END) {
+            job->state = BZ_OK;
+            break;
+        }
+        if (state != BZ_OK) {
+            job->state = state;
+            break;
+        }
+        if (!bzs.avail_out) {
+            if (!(out = realloc(job->out, job->outsize * 2))) {
+                job->state = BZ_MEM_ERROR;
+                break;
+            }
+            job->out = out;
+            job->outsize *= 2;
+        } else if (!bzs.avail_in) {
+            job->state = BZ_UNEXPECTED_EOF;
+            break;
+        }
+    }
+    BZ2_bzDecompressEnd(&bzs);
+    free(bits.buf);
+    job->time = bz_now() - start;
+}
+
+/*
+ * Closes the open segment at bit end of the input, and opens a new one of
+ * type next there. Blocks are handed over to the thread pool, anything else
+ * (the end of stream marker and the stream CRC) is kept in order but never
+ * decoded.
+ */
+void bz_preader_cut(struct bz_file *bzf, unsigned long long end, int next) {
+    struct bz_preader *pr = bzf->pr;
+    struct bz_job *job;
+    size_t first, last;
+
+    if (pr->segment) {
+        first = (size_t) (pr->segbit / 8 - pr->base);
+        last = (size_t) ((end + 7) / 8 - pr->base);
+        job = ALLOC(struct bz_job);
+        MEMZERO(job, struct bz_job, 1);
+        job->inlen = (unsigned int) (last - first);
+        job->in = bz_job_malloc(job->inlen);
+        MEMCPY(job->in, pr->data + first, char, job->inlen);
+        job->inbit = (unsigned int) (pr->segbit & 7);
+        job->nbits = (size_t) (end - pr->segbit);
+        job->bit = pr->segbit;
+        if (pr->last) {
+            pr->last->order = job;
+        } else {
+            pr->first = job;
+        }
+        pr->last = job;
+        if (pr->segment == BZ_SEGMENT_BLOCK) {
+            job->run = bz_preader_run;
+            if (!pr->pool) {
+                pr->pool = bz_pool_new(pr->threads);
+            }
+            bz_pool_submit(pr->pool, job);
+            pr->pending++;
+        } else {
+            job->state = BZ_OK;
+            job->done = 1;
+        }
+    }
+    pr->segment = next;
+    pr->segbit = end;
+}
+
+/*
+ * Feeds the input read so far through a 48 bit window, cutting it up at
+ * every block and end of stream magic. Neither is byte aligned, so all 8
+ * shifts are checked.
+ */
+void bz_preader_scan(struct bz_file *bzf) {
+    struct bz_preader *pr = bzf->pr;
+    unsigned long long v;
+    int k;
+
+    while (pr->scanned < pr->datalen) {
+        pr->window = (pr->window << 8) |
+            (unsigned char) pr->data[pr->scanned++];
+        for (k = 7; k >= 0; k--) {
+            v = (pr->window >> k) & BZ_MAGIC_MASK;
+            if (v == BZ_BLOCK_MAGIC || v == BZ_EOS_MAGIC) {
+                bz_preader_cut(bzf, (pr->base + pr->scanned) * 8 - k - 48,
+                    v == BZ_BLOCK_MAGIC ? BZ_SEGMENT_BLOCK : BZ_SEGMENT_TRAILER);
+            }
+        }
+    }
+}
+
+/*
+ * Reads and scans one more piece of the input. Returns 0 at the end of the
+ * input, after the last segment has been closed.
+ */
+int bz_preader_read(struct bz_file *bzf) {
+    struct bz_preader *pr = bzf->pr;
+    VALUE in;
+    size_t drop, len;
+    double start;
+
+    if (pr->eof) {
+        return 0;
+    }
+    if (pr->segment) {
+        drop = (size_t) (pr->segbit / 8 - pr->base);
+        if (drop) {
+            memmove(pr->data, pr->data + drop, pr->datalen - drop);
+            pr->datalen -= drop;
+            pr->scanned -= drop;
+            pr->base += drop;
+        }
+    }
+    BZ_PROBE1(io__read__start, BZ_RB_PREADSIZE);
+    start = bz_now();
+    in = rb_funcall(bzf->io, id_read, 1, INT2FIX(BZ_RB_PREADSIZE));
+    bz_stats_io(bzf, 0, start);
+    BZ_PROBE1(io__read__done, TYPE(in) == T_STRING ? RSTRING_LEN(in) : 0);
+    if (TYPE(in) != T_STRING || RSTRING_LEN(in) == 0) {
+        pr->eof = 1;
+        if (!pr->segbit) {
+            bz_raise(BZ_UNEXPECTED_EOF);
+        }
+        bz_preader_cut(bzf, (pr->base + pr->datalen) * 8, 0);
+        return 0;
+    }
+    bzf->in = in;
+    len = RSTRING_LEN(in);
+    if (pr->datalen + len > pr->datasize) {
+        pr->datasize = pr->datalen + len;
+        REALLOC_N(pr->data, char, pr->datasize);
+    }
+    MEMCPY(pr->data + pr->datalen, RSTRING_PTR(in), char, len);
+    pr->datalen += len;
+    if (!pr->base && pr->scanned < 4 && pr->datalen >= 4) {
+        if (pr->data[0] != 'B' || pr->data[1] != 'Z' || pr->data[2] != 'h' ||
+            pr->data[3] < '1' || pr->data[3] > '9') {
+            bz_raise(BZ_DATA_ERROR_MAGIC);
+        }
+    }
+    bz_preader_scan(bzf);
+    return 1;
+}
+
+/*
+ * Takes the segment at the front off the list
+ */
+void bz_preader_pop(struct bz_file *bzf) {
+    struct bz_preader *pr = bzf->pr;
+    struct bz_job *job = pr->first;
+
+    pr->first = job->order;
+    if (!pr->first) {
+        pr->last = 0;
+    }
+    if (job->run) {
+        pr->pending--;
+        bz_stats_lib(bzf, 1, job->inlen, job->outlen, job->time);
+    }
+    if (pr->cur == job) {
+        pr->cur = 0;
+    }
+    bz_job_free(job);
+}
+
+/*
+ * The segment at the front failed to decode. A block can contain something
+ * which looks like a magic by accident, in which case it was cut up too
+ * eagerly: glue the following segments onto it one by one until it decodes,
+ * or is longer than any block can be.
+ */
+void bz_preader_merge(struct bz_file *bzf) {
+    struct bz_preader *pr = bzf->pr;
+    struct bz_job *job, *last, *merged;
+    struct bz_bits bits;
+    int state = pr->first->state, n;
+
+    last = pr->first;
+    while (1) {
+        while (!last->order && bz_preader_read(bzf));
+        if (!(last = last->order)) {
+            bz_raise(state);
+        }
+        merged = ALLOC(struct bz_job);
+        MEMZERO(merged, struct bz_job, 1);
+        bits.buf = 0;
+        bits.len = bits.size = 0;
+        for (job = pr->first; ; job = job->order) {
+            if (!bz_bits_put(&bits, (unsigned char *) job->in, job->inbit,
+                    job->nbits)) {
+                free(bits.buf);
+                xfree(merged);
+                rb_memerror();
+            }
+            if (job == last) {
+                break;
+            }
+        }
+        if (bits.len > BZ_BLOCK_MAXBITS) {
+            free(bits.buf);
+            xfree(merged);
+            bz_raise(BZ_DATA_ERROR);
+        }
+        merged->run = bz_preader_run;
+        merged->in = (char *) bits.buf;
+        merged->inlen = (unsigned int) ((bits.len + 7) / 8);
+        merged->nbits = bits.len;
+        merged->bit = pr->first->bit;
+        bz_blocking_call(bzf, bz_pool_run_i, merged, 0, 0);
+        if (merged->state == BZ_OK) {
+            break;
+        }
+        bz_job_free(merged);
+    }
+    /* the workers may still be busy with the segments swallowed up */
+    n = 0;
+    merged->order = last->order;
+    while (1) {
+        job = pr->first;
+        if (job->run) {
+            bz_pool_wait(bzf, pr->pool, job);
+            n++;
+        }
+        pr->first = job->order;
+        bz_job_free(job);
+        if (job == last) {
+            break;
+        }
+    }
+    pr->first = merged;
+    if (!merged->order) {
+        pr->last = merged;
+    }
+    merged->done = 1;
+    pr->pending -= n - 1;
+}
+
+/*
+ * Returns the decoded block at the front, keeping up to pr->jobs of them in
+ * flight, or 0 at the end of the input. Anything without output (or output
+ * which a seek skips) is dropped on the way.
+ */
+struct bz_job * bz_preader_front(struct bz_file *bzf) {
+    struct bz_preader *pr = bzf->pr;
+    struct bz_job *job;
+
+    while (!(job = pr->cur)) {
+        while (pr->pending < pr->jobs && bz_preader_read(bzf));
+        if (!(job = pr->first)) {
+            return 0;
+        }
+        if (job->run) {
+            bz_pool_wait(bzf, pr->pool, job);
+        }
+        if (job->state != BZ_OK) {
+            bz_preader_merge(bzf);
+            job = pr->first;
+        }
+        if (job->outlen <= pr->skip) {
+            pr->skip -= job->outlen;
+            bz_preader_pop(bzf);
+            continue;
+        }
+        pr->cur = job;
+        pr->curpos = (unsigned int) pr->skip;
+        pr->skip = 0;
+    }
+    return job;
+}
+
+/*
+ * Replacement of bz_next_available for a Bzip2::ParallelReader: hands out
+ * the decoded segments in order.
+ */
+int bz_preader_next_available(struct bz_file *bzf, int in) {
+    struct bz_preader *pr = bzf->pr;
+    struct bz_job *job;
+    unsigned int n;
+
+    bzf->bzs.next_out = bzf->buf;
+    bzf->bzs.avail_out = 0;
+    if (bzf->state == BZ_STREAM_END) {
+        return BZ_STREAM_END;
+    }
+    if (!(job = bz_preader_front(bzf))) {
+        bzf->state = BZ_STREAM_END;
+        return BZ_STREAM_END;
+    }
+    if ((bzf->buflen - in) < (BZ_RB_BLOCKSIZE / 2)) {
+        REALLOC_N(bzf->buf, char, bzf->buflen+BZ_RB_BLOCKSIZE+1);
+        bzf->buflen += BZ_RB_BLOCKSIZE;
+        bzf->buf[bzf->buflen] = '\0';
+        bz_stats_buf(bzf, bzf->buflen);
+    }
+    n = job->outlen - pr->curpos;
+    if (n > bzf->buflen - in) {
+        n = bzf->buflen - in;
+    }
+    MEMCPY(bzf->buf + in, job->out + pr->curpos, char, n);
+    pr->curpos += n;
+    bzf->decoded += n;
+    if (pr->curpos == job->outlen) {
+        bz_preader_pop(bzf);
+    }
+    bzf->bzs.avail_out = in + n;
+    bzf->bzs.next_out = bzf->buf;
+    return 0;
+}
+
+/*
+ * Starts over at the block at bit of the input, which the caller has
+ * already positioned the io at (rounded down to a byte), dropping the first
+ * skip bytes of its output. A plain Bzip2::Reader switches over to reading
+ * block by block here, on a pool without threads.
+ */
+void bz_preader_seek(struct bz_file *bzf, unsigned long long bit,
+    unsigned long long skip) {
+    struct bz_preader *pr = bzf->pr;
+    int threads = 0, jobs = 1;
+
+    if (pr) {
+        threads = pr->threads;
+        jobs = pr->jobs;
+        bz_preader_free(pr);
+    }
+    pr = bzf->pr = ALLOC(struct bz_preader);
+    MEMZERO(pr, struct bz_preader, 1);
+    pr->threads = threads;
+    pr->jobs = jobs;
+    pr->base = bit / 8;
+    pr->skip = skip;
+}
+
+void bz_preader_free(struct bz_preader *pr) {
+    struct bz_job *job;
+
+    if (pr->pool) {
+        bz_pool_free(pr->pool);
+    }
+    while ((job = pr->first)) {
+        pr->first = job->order;
+        bz_job_free(job);
+    }
+    if (pr->data) {
+        xfree(pr->data);
+    }
+    xfree(pr);
+}
+
+/*
+ * call-seq:
+ *    initialize(io, options = {})
+ *
+ * Creates a new Bzip2::ParallelReader. It behaves just like a
+ * Bzip2::Reader, but the input is cut up at its block boundaries and the
+ * blocks are decompressed on a pool of native threads. Concatenated streams
+ * (as written by Bzip2::ParallelWriter or +pbzip2+) are read as a whole.
+ *
+ *    reader = Bzip2::ParallelReader.new File.open('file.bz2', 'rb'), :threads => 4
+ *    reader.each_line { |line| ... }
+ *
+ * Each block is checked against its own CRC, the combined CRC of a stream is
+ * not verified.
+ *
+ * @param [File, String, #read] io the source of compressed data, see
+ *    Bzip2::Reader#initialize
+ * @param [Hash] options
+ * @option options [Integer] :threads (number of processors) the number of
+ *    threads decompressing blocks
+ */
+VALUE bz_preader_init(int argc, VALUE *argv, VALUE obj) {
+    struct bz_file *bzf;
+    struct bz_preader *pr;
+    VALUE io, opts, v;
+    int threads;
+
+    rb_scan_args(argc, argv, "11", &io, &opts);
+    if (!NIL_P(opts)) {
+        Check_Type(opts, T_HASH);
+    }
+    threads = bz_cpu_count();
+    if (!NIL_P(v = bz_opt(opts, "threads"))) {
+        threads = NUM2INT(v);
+        if (threads < 1) {
+            rb_raise(rb_eArgError, "invalid number of threads %d", threads);
+        }
+    }
+
+    bz_reader_init(argc, argv, obj);
+    Data_Get_BZ2(obj, bzf);
+    if (!bzf->pr) {
+        bzf->pr = ALLOC(struct bz_preader);
+        MEMZERO(bzf->pr, struct bz_preader, 1);
+    }
+    pr = bzf->pr;
+    pr->threads = threads;
+    pr->jobs = threads * 2;
+    return obj;
+}
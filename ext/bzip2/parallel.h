@@ -0,0 +1,86 @@
+#ifndef _RB_BZIP2_PARALLEL_H_
+#define _RB_BZIP2_PARALLEL_H_
+
+#include <ruby.h>
+#include "common.h"
+
+#ifdef HAVE_PTHREAD_H
+#  include <pthread.h>
+#endif
+
+struct bz_job {
+    struct bz_job *next;        /* queue of the pool */
+    struct bz_job *order;       /* stream order of the owner */
+    void (*run)(struct bz_job *job);
+    char *in, *out;
+    unsigned int inlen, outlen, outsize;
+    unsigned int inbit;         /* first bit of a segment in +in+ */
+    size_t nbits;               /* length of a segment in bits */
+    unsigned long long bit;     /* where the segment starts in the input */
+    double time;                /* seconds spent in libbzip2 */
+    int blocks, work, state, done;
+};
+
+struct bz_pool {
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_t lock;
+    pthread_cond_t wake, done;
+    pthread_t *threads;
+#endif
+    struct bz_job *head, *tail;
+    int nthreads, shutdown, interrupted;
+};
+
+struct bz_pwriter {
+    struct bz_pool *pool;
+    struct bz_job *first, *last;
+    char *chunk;
+    unsigned int chunklen, chunksize;
+    size_t inflight, memory;
+    int threads;
+};
+
+#define BZ_RB_PREADSIZE (1024 * 1024)
+
+struct bz_preader {
+    struct bz_pool *pool;
+    struct bz_job *first, *last;
+    struct bz_job *cur;         /* segment being handed out */
+    unsigned int curpos;
+    char *data;                 /* input which hasn't been cut up yet */
+    size_t datalen, datasize, scanned;
+    unsigned long long base;    /* offset of data[0] in the input */
+    unsigned long long segbit;  /* bit offset of the open segment */
+    unsigned long long window;
+    unsigned long long skip;    /* output to drop after a seek */
+    int threads, jobs, pending, segment, eof;
+};
+
+/* Thread pool */
+struct bz_pool * bz_pool_new(int nthreads);
+void bz_pool_submit(struct bz_pool *pool, struct bz_job *job);
+int bz_pool_done(struct bz_pool *pool, struct bz_job *job);
+void bz_pool_wait(struct bz_file *bzf, struct bz_pool *pool, struct bz_job *job);
+void bz_pool_free(struct bz_pool *pool);
+void * bz_job_malloc(size_t size);
+void bz_job_free(struct bz_job *job);
+int bz_cpu_count(void);
+
+/* Bzip2::ParallelWriter */
+VALUE bz_pwriter_write(struct bz_file *bzf, VALUE str);
+void bz_pwriter_flush(struct bz_file *bzf, int closed);
+void bz_pwriter_free(struct bz_pwriter *pw);
+
+/* Bzip2::ParallelReader */
+int bz_preader_next_available(struct bz_file *bzf, int in);
+struct bz_job * bz_preader_front(struct bz_file *bzf);
+void bz_preader_pop(struct bz_file *bzf);
+void bz_preader_seek(struct bz_file *bzf, unsigned long long bit,
+    unsigned long long skip);
+void bz_preader_free(struct bz_preader *pr);
+
+/* Instance methods */
+VALUE bz_pwriter_init(int argc, VALUE *argv, VALUE obj);
+VALUE bz_preader_init(int argc, VALUE *argv, VALUE obj);
+
+#endif
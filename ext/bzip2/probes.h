@@ -0,0 +1,37 @@
+#ifndef _RB_BZIP2_PROBES_H_
+#define _RB_BZIP2_PROBES_H_
+
+/*
+ * Static tracepoints of the provider "bzip2", for SystemTap, bpftrace and
+ * friends. With sys/sdt.h each one is a single nop until someone attaches
+ * to it; without it they compile to nothing.
+ *
+ *    compress__start(avail_in, action)      before BZ2_bzCompress
+ *    compress__done(bytes_in, bytes_out)    after it, bytes consumed/produced
+ *    decompress__start(avail_in, avail_out) before BZ2_bzDecompress
+ *    decompress__done(bytes_in, bytes_out)  after it
+ *    stream__end(total_in, total_out)       a stream was finished or read
+ *    io__read__start(size)                  before reading the io
+ *    io__read__done(bytes)                  after it, 0 at the end
+ *    io__write__start(bytes)                before writing to the io
+ *    io__write__done(bytes)                 after it
+ *
+ *    bpftrace -e 'usdt:bzip2.so:bzip2:io__read__done { @ = hist(arg0); }'
+ */
+#ifdef HAVE_SYS_SDT_H
+#  include <sys/sdt.h>
+#  define BZ_PROBE1(name, a) \
+    DTRACE_PROBE1(bzip2, name, a)
+#  define BZ_PROBE2(name, a, b) \
+    DTRACE_PROBE2(bzip2, name, a, b)
+#else
+#  define BZ_PROBE1(name, a)
+#  define BZ_PROBE2(name, a, b)
+#endif
+
+#define BZ_TOTAL_IN(bzs) \
+    (((unsigned long long) (bzs)->total_in_hi32 << 32) | (bzs)->total_in_lo32)
+#define BZ_TOTAL_OUT(bzs) \
+    (((unsigned long long) (bzs)->total_out_hi32 << 32) | (bzs)->total_out_lo32)
+
+#endif
@@ -1,8 +1,17 @@
 #include <bzlib.h>
 #include <ruby.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#ifdef HAVE_SYS_MMAN_H
+#  include <sys/mman.h>
+#endif
 
 #include "reader.h"
 #include "common.h"
+#include "parallel.h"
+#include "index.h"
+#include "probes.h"
 
 void bz_str_mark(struct bz_str *bzs) {
     rb_gc_mark(bzs->str);
@@ -16,13 +25,15 @@ struct bz_file * bz_get_bzf(VALUE obj) {
         if (bzf->state != BZ_OK) {
             bz_raise(bzf->state);
         }
-        bzf->state = BZ2_bzDecompressInit(&(bzf->bzs), 0, bzf->small);
-        if (bzf->state != BZ_OK) {
-            BZ2_bzDecompressEnd(&(bzf->bzs));
-            bz_raise(bzf->state);
+        if (!bzf->pr) {
+            bzf->state = BZ2_bzDecompressInit(&(bzf->bzs), 0, bzf->small);
+            if (bzf->state != BZ_OK) {
+                BZ2_bzDecompressEnd(&(bzf->bzs));
+                bz_raise(bzf->state);
+            }
         }
-        bzf->buf = ALLOC_N(char, BZ_RB_BLOCKSIZE + 1);
         bzf->buflen = BZ_RB_BLOCKSIZE;
+        bzf->buf = bz_buf_alloc(bzf, &bzf->buflen);
         bzf->buf[0] = bzf->buf[bzf->buflen] = '\0';
         bzf->bzs.total_out_hi32 = bzf->bzs.total_out_lo32 = 0;
         bzf->bzs.next_out = bzf->buf;
@@ -34,31 +45,247 @@ struct bz_file * bz_get_bzf(VALUE obj) {
     return bzf;
 }
 
+struct bz_decompress_arg {
+    struct bz_file *bzf;
+    int state;
+    double time;
+};
+
+void * bz_reader_decompress_i(void *ptr) {
+    struct bz_decompress_arg *arg = ptr;
+    double start = bz_now();
+
+    arg->state = BZ2_bzDecompress(&(arg->bzf->bzs));
+    arg->time = bz_now() - start;
+    return 0;
+}
+
+/*
+ * Runs BZ2_bzDecompress with the GVL released. bzf->in is a frozen string
+ * referenced (and so marked) by the reader, and bzf->buf can't be resized by
+ * anyone else while the stream is flagged busy. A single call only produces
+ * up to bzf->buflen bytes so no unblocking function is needed.
+ */
+int bz_reader_decompress(struct bz_file *bzf) {
+    struct bz_decompress_arg arg;
+    unsigned int in = bzf->bzs.avail_in, out = bzf->bzs.avail_out;
+
+    arg.bzf = bzf;
+    arg.state = BZ_OK;
+    arg.time = 0;
+    BZ_PROBE2(decompress__start, in, out);
+    bz_blocking_call(bzf, bz_reader_decompress_i, &arg, 0, 0);
+    bz_stats_lib(bzf, 1, in - bzf->bzs.avail_in, out - bzf->bzs.avail_out,
+        arg.time);
+    BZ_PROBE2(decompress__done, in - bzf->bzs.avail_in,
+        out - bzf->bzs.avail_out);
+    if (arg.state == BZ_STREAM_END) {
+        BZ_PROBE2(stream__end, BZ_TOTAL_IN(&bzf->bzs), BZ_TOTAL_OUT(&bzf->bzs));
+    }
+    return arg.state;
+}
+
+/*
+ * Gives the pages of the mapping which have been decompressed already back
+ * to the system, everything before map->pos has been consumed.
+ */
+void bz_map_drop(struct bz_map *map) {
+#if defined(HAVE_MADVISE) && defined(MADV_DONTNEED)
+    size_t upto = map->pos - map->pos % sysconf(_SC_PAGESIZE);
+
+    if (upto > map->dropped) {
+        madvise(map->ptr + map->dropped, upto - map->dropped, MADV_DONTNEED);
+        map->dropped = upto;
+    }
+#endif
+}
+
+void bz_map_free(struct bz_map *map) {
+#ifdef HAVE_MMAP
+    if (map->ptr) {
+        munmap(map->ptr, map->len);
+    }
+#endif
+    free(map);
+}
+
+/*
+ * The mapping can also be read like any other io, which is what a
+ * Bzip2::ParallelReader does.
+ * @private
+ */
+VALUE bz_map_read(int argc, VALUE *argv, VALUE obj) {
+    struct bz_map *map;
+    VALUE len;
+    long count;
+
+    Data_Get_Struct(obj, struct bz_map, map);
+    rb_scan_args(argc, argv, "01", &len);
+    count = (long) (map->len - map->pos);
+    if (!NIL_P(len) && NUM2LONG(len) < count) {
+        count = NUM2LONG(len);
+        if (count < 0) {
+            rb_raise(rb_eArgError, "negative length %ld given", count);
+        }
+    }
+    if (!count) {
+        return Qnil;
+    }
+    bz_map_drop(map);
+    map->pos += count;
+    return rb_str_new(map->ptr + map->pos - count, count);
+}
+
+/*
+ * Fetches the next iosize bytes of input. For a plain File they are read
+ * straight from the descriptor into a string private to the reader, which
+ * is reused from then on; anything else is asked for them with #read.
+ * Strings and mapped files aren't copied at all, next_in points right into
+ * them.
+ *
+ * @return 0 at the end of the input
+ */
+int bz_reader_fill(struct bz_file *bzf) {
+    VALUE in;
+    long n;
+    int fd;
+    double start;
+
+    if (bzf->flags & BZ2_RB_MAP) {
+        struct bz_map *map;
+
+        Data_Get_Struct(bzf->io, struct bz_map, map);
+        bz_map_drop(map);
+        n = (long) (map->len - map->pos);
+        if (n > BZ_RB_MAPSIZE) {
+            n = BZ_RB_MAPSIZE;
+        }
+        bzf->in = bzf->io;
+        bzf->bzs.next_in = map->ptr + map->pos;
+        bzf->bzs.avail_in = (unsigned int) n;
+        map->pos += n;
+        return n > 0;
+    }
+    if (bzf->flags & BZ2_RB_STRING) {
+        struct bz_str *bzs;
+
+        Data_Get_Struct(bzf->io, struct bz_str, bzs);
+        if (bzs->pos == -1) {
+            return 0;
+        }
+        n = RSTRING_LEN(bzs->str) - bzs->pos;
+        if (n > BZ_RB_STRSIZE) {
+            n = BZ_RB_STRSIZE;
+        }
+        bzf->in = bzs->str;
+        bzf->bzs.next_in = RSTRING_PTR(bzs->str) + bzs->pos;
+        bzf->bzs.avail_in = (unsigned int) n;
+        bzs->pos += n;
+        if (bzs->pos == RSTRING_LEN(bzs->str)) {
+            bzs->pos = -1;
+        }
+        return n > 0;
+    }
+    if ((fd = bz_io_fd(bzf->io, 0)) >= 0) {
+        if (!bzf->in || OBJ_FROZEN(bzf->in) ||
+            RSTRING_LEN(bzf->in) != (long) bzf->iosize) {
+            bzf->in = rb_str_new(0, bzf->iosize);
+        }
+        BZ_PROBE1(io__read__start, bzf->iosize);
+        start = bz_now();
+        n = bz_fd_read(bzf, fd, RSTRING_PTR(bzf->in), bzf->iosize);
+        bz_stats_io(bzf, 0, start);
+        if (n >= 0) {
+            BZ_PROBE1(io__read__done, n);
+            bzf->bzs.next_in  = RSTRING_PTR(bzf->in);
+            bzf->bzs.avail_in = (unsigned int) n;
+            return n > 0;
+        }
+    }
+    BZ_PROBE1(io__read__start, bzf->iosize);
+    start = bz_now();
+    in = rb_funcall(bzf->io, id_read, 1, UINT2NUM(bzf->iosize));
+    bz_stats_io(bzf, 0, start);
+    if (TYPE(in) != T_STRING || RSTRING_LEN(in) == 0) {
+        BZ_PROBE1(io__read__done, 0);
+        return 0;
+    }
+    BZ_PROBE1(io__read__done, RSTRING_LEN(in));
+    bzf->in = rb_str_new_frozen(in);
+    bzf->bzs.next_in  = RSTRING_PTR(bzf->in);
+    bzf->bzs.avail_in = (int) RSTRING_LEN(bzf->in);
+    return 1;
+}
+
+/*
+ * Called at the end of a stream in multistream mode. If more input follows,
+ * the bz_stream is set up again in place for the next stream, keeping the
+ * input which hasn't been consumed yet along with bzf->buf.
+ *
+ * Input which doesn't start with the magic of a stream ends the data, it's
+ * left for Bzip2::Reader#unused. Only the bytes at hand are checked, so
+ * garbage cut off within the first four bytes still makes libbzip2 fail.
+ *
+ * @return 1 if there is another stream or 0 at the end of the input
+ */
+int bz_next_stream(struct bz_file *bzf) {
+    static const char magic[] = "BZh";
+    char *next_in, *next_out;
+    unsigned int avail_in, avail_out, i;
+
+    if (!bzf->bzs.avail_in && !bz_reader_fill(bzf)) {
+        return 0;
+    }
+    for (i = 0; i < bzf->bzs.avail_in && i < 4; i++) {
+        if (i < 3 ? bzf->bzs.next_in[i] != magic[i] :
+            bzf->bzs.next_in[i] < '1' || bzf->bzs.next_in[i] > '9') {
+            return 0;
+        }
+    }
+    next_in = bzf->bzs.next_in;
+    avail_in = bzf->bzs.avail_in;
+    next_out = bzf->bzs.next_out;
+    avail_out = bzf->bzs.avail_out;
+    BZ2_bzDecompressEnd(&(bzf->bzs));
+    bzf->state = BZ2_bzDecompressInit(&(bzf->bzs), 0, bzf->small);
+    if (bzf->state != BZ_OK) {
+        bz_raise(bzf->state);
+    }
+    bzf->bzs.next_in = next_in;
+    bzf->bzs.avail_in = avail_in;
+    bzf->bzs.next_out = next_out;
+    bzf->bzs.avail_out = avail_out;
+    return 1;
+}
+
 int bz_next_available(struct bz_file *bzf, int in){
+    if (bzf->pr) {
+        return bz_preader_next_available(bzf, in);
+    }
     bzf->bzs.next_out = bzf->buf;
     bzf->bzs.avail_out = 0;
     if (bzf->state == BZ_STREAM_END) {
         return BZ_STREAM_END;
     }
-    if (!bzf->bzs.avail_in) {
-        bzf->in = rb_funcall(bzf->io, id_read, 1, INT2FIX(1024));
-        if (TYPE(bzf->in) != T_STRING || RSTRING_LEN(bzf->in) == 0) {
-            BZ2_bzDecompressEnd(&(bzf->bzs));
-            bzf->bzs.avail_out = 0;
-            bzf->state = BZ_UNEXPECTED_EOF;
-            bz_raise(bzf->state);
-        }
-        bzf->bzs.next_in  = RSTRING_PTR(bzf->in);
-        bzf->bzs.avail_in = (int) RSTRING_LEN(bzf->in);
+    if (!bzf->bzs.avail_in && !bz_reader_fill(bzf)) {
+        BZ2_bzDecompressEnd(&(bzf->bzs));
+        bzf->bzs.avail_out = 0;
+        bzf->state = BZ_UNEXPECTED_EOF;
+        bz_raise(bzf->state);
     }
     if ((bzf->buflen - in) < (BZ_RB_BLOCKSIZE / 2)) {
         bzf->buf = REALLOC_N(bzf->buf, char, bzf->buflen+BZ_RB_BLOCKSIZE+1);
         bzf->buflen += BZ_RB_BLOCKSIZE;
         bzf->buf[bzf->buflen] = '\0';
+        bz_stats_buf(bzf, bzf->buflen);
     }
     bzf->bzs.avail_out = bzf->buflen - in;
     bzf->bzs.next_out = bzf->buf + in;
-    bzf->state = BZ2_bzDecompress(&(bzf->bzs));
+    bzf->state = bz_reader_decompress(bzf);
+    if (bzf->state == BZ_STREAM_END && (bzf->flags & BZ2_RB_MULTISTREAM) &&
+        bz_next_stream(bzf)) {
+        bzf->state = BZ_OK;
+    }
     if (bzf->state != BZ_OK) {
         BZ2_bzDecompressEnd(&(bzf->bzs));
         if (bzf->state != BZ_STREAM_END) {
@@ -68,22 +295,34 @@ int bz_next_available(struct bz_file *bzf, int in){
     }
     bzf->bzs.avail_out = bzf->buflen - bzf->bzs.avail_out;
     bzf->bzs.next_out = bzf->buf;
+    bzf->decoded += bzf->bzs.avail_out - in;
     return 0;
 }
 
+/*
+ * Appends len bytes at ptr to res, which is only created once there's
+ * something to put in it: a line found in the buffer in one go costs a
+ * single string.
+ */
+VALUE bz_str_append(VALUE res, const char *ptr, long len) {
+    if (NIL_P(res)) {
+        return rb_str_new(ptr, len);
+    }
+    return rb_str_cat(res, ptr, len);
+}
+
 VALUE bz_read_until(struct bz_file *bzf, const char *str, int len, int *td1) {
-    VALUE res;
+    VALUE res = Qnil;
     int total, i, nex = 0;
     char *p, *t, *tx, *end, *pend = ((char*) str) + len;
 
-    res = rb_str_new(0, 0);
     while (1) {
         total = bzf->bzs.avail_out;
         if (len == 1) {
             tx = memchr(bzf->bzs.next_out, *str, bzf->bzs.avail_out);
             if (tx) {
                 i = (int)(tx - bzf->bzs.next_out + len);
-                res = rb_str_cat(res, bzf->bzs.next_out, i);
+                res = bz_str_append(res, bzf->bzs.next_out, i);
                 bzf->bzs.next_out += i;
                 bzf->bzs.avail_out -= i;
                 return res;
@@ -97,13 +336,13 @@ VALUE bz_read_until(struct bz_file *bzf, const char *str, int len, int *td1) {
                 }
                 if (p == pend) {
                     i = (int)(tx - bzf->bzs.next_out + len);
-                    res = rb_str_cat(res, bzf->bzs.next_out, i);
+                    res = bz_str_append(res, bzf->bzs.next_out, i);
                     bzf->bzs.next_out += i;
                     bzf->bzs.avail_out -= i;
                     return res;
                 }
                 if (td1) {
-                    tx += td1[(int)*(tx + len)];
+                    tx += td1[(unsigned char)*(tx + len)];
                 } else {
                     tx += 1;
                 }
@@ -112,19 +351,20 @@ VALUE bz_read_until(struct bz_file *bzf, const char *str, int len, int *td1) {
         nex = 0;
         if (total) {
             nex = len - 1;
-            res = rb_str_cat(res, bzf->bzs.next_out, total - nex);
+            if (total > nex) {
+                res = bz_str_append(res, bzf->bzs.next_out, total - nex);
+            } else {
+                nex = total;
+            }
             if (nex) {
                 MEMMOVE(bzf->buf, bzf->bzs.next_out + total - nex, char, nex);
             }
         }
         if (bz_next_available(bzf, nex) == BZ_STREAM_END) {
             if (nex) {
-                res = rb_str_cat(res, bzf->buf, nex);
-            }
-            if (RSTRING_LEN(res)) {
-                return res;
+                res = bz_str_append(res, bzf->buf, nex);
             }
-            return Qnil;
+            return res;
         }
     }
     return Qnil;
@@ -156,6 +396,31 @@ int bz_read_while(struct bz_file *bzf, char c) {
     return EOF;
 }
 
+void bz_reader_free(struct bz_file *bzf) {
+    if (bzf->pr) {
+        bz_preader_free(bzf->pr);
+    }
+    if (bzf->bzs.state) {
+        BZ2_bzDecompressEnd(&(bzf->bzs));
+    }
+    bz_mem_report(bzf);
+    bzf->flags &= ~BZ2_RB_RESET;
+    bz_buf_release(bzf);
+    free(bzf);
+}
+
+#ifdef HAVE_RB_DATA_TYPE_T_PARENT
+const rb_data_type_t bz_reader_type = {
+    "Bzip2::Reader",
+    {(RUBY_DATA_FUNC)bz_file_mark, (RUBY_DATA_FUNC)bz_reader_free,
+        bz_file_memsize},
+    &bz_file_type, 0,
+#ifdef RUBY_TYPED_FREE_IMMEDIATELY
+    RUBY_TYPED_FREE_IMMEDIATELY
+#endif
+};
+#endif
+
 /*
  * Internally allocates data for a new Reader
  * @private
@@ -163,9 +428,14 @@ int bz_read_while(struct bz_file *bzf, char c) {
 VALUE bz_reader_s_alloc(VALUE obj) {
     struct bz_file *bzf;
     VALUE res;
-    res = Data_Make_Struct(obj, struct bz_file, bz_file_mark, free, bzf);
+#ifdef HAVE_RB_DATA_TYPE_T_PARENT
+    res = TypedData_Make_Struct(obj, struct bz_file, &bz_reader_type, bzf);
+#else
+    res = Data_Make_Struct(obj, struct bz_file, bz_file_mark, bz_reader_free, bzf);
+#endif
     bzf->bzs.bzalloc = bz_malloc;
     bzf->bzs.bzfree = bz_free;
+    bzf->bzs.opaque = bzf;
     bzf->blocks = DEFAULT_BLOCKS;
     bzf->state = BZ_OK;
     return res;
@@ -206,7 +476,7 @@ VALUE bz_reader_s_open(int argc, VALUE *argv, VALUE obj) {
         return Qnil;
     }
     res = rb_funcall2(obj, id_new, argc, argv);
-    Data_Get_Struct(res, struct bz_file, bzf);
+    Data_Get_BZ2(res, bzf);
     bzf->flags |= BZ2_RB_CLOSE;
     if (rb_block_given_p()) {
         return rb_ensure(rb_yield, res, bz_reader_close, res);
@@ -214,25 +484,155 @@ VALUE bz_reader_s_open(int argc, VALUE *argv, VALUE obj) {
     return res;
 }
 
+/*
+ * Picks how much to ask the io for at once: a multiple of the preferred
+ * block size for regular files, a fixed size for anything else.
+ */
+unsigned int bz_reader_read_size(VALUE io) {
+#if defined(HAVE_STRUCT_STAT_ST_BLKSIZE) || defined(HAVE_ST_BLKSIZE)
+    if (TYPE(io) == T_FILE) {
+#if defined(HAVE_RB_IO_DESCRIPTOR)
+#elif !defined(RUBY_19_COMPATIBILITY)
+        OpenFile *fptr;
+#else
+        rb_io_t *fptr;
+#endif
+        struct stat st;
+        int fd;
+
+#if defined(HAVE_RB_IO_DESCRIPTOR)
+        fd = rb_io_descriptor(io);
+#elif !defined(RUBY_19_COMPATIBILITY)
+        GetOpenFile(io, fptr);
+        fd = fileno(fptr->f);
+#else
+        GetOpenFile(io, fptr);
+        fd = fptr->fd;
+#endif
+        if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_blksize > 0) {
+            return ((BZ_RB_FILE_READSIZE + st.st_blksize - 1) / st.st_blksize)
+                * st.st_blksize;
+        }
+    }
+#endif
+    return BZ_RB_READSIZE;
+}
+
 /*
  * call-seq:
- *    initialize(io)
+ *   mmap(filename, options = {}, &block=nil) -> Bzip2::Reader
+ *
+ * Maps the file into memory and decompresses straight out of the mapping,
+ * so the compressed data is never copied into ruby strings. The pages are
+ * read ahead sequentially and given back once they've been decompressed.
+ * Otherwise this is just like Bzip2::Reader.open.
+ *
+ *    Bzip2::Reader.mmap('file.bz2', :multistream => true) do |reader|
+ *      reader.each_line { |line| ... }
+ *    end
+ *
+ * @param [String] filename the name of the file to read from
+ * @param [Hash] options see Bzip2::Reader#initialize
+ * @yieldparam [Bzip2::Reader] reader the Bzip2::Reader instance
+ * @return [Bzip2::Reader, nil]
+ * @raise [NotImplementedError] if the system doesn't support mmap
+ */
+VALUE bz_reader_s_mmap(int argc, VALUE *argv, VALUE obj) {
+#ifdef HAVE_MMAP
+    struct bz_map *map;
+    struct stat st;
+    VALUE path, opts, res, args[2];
+    void *ptr = 0;
+    int fd;
+
+    rb_scan_args(argc, argv, "11", &path, &opts);
+    FilePathValue(path);
+    if ((fd = open(RSTRING_PTR(path), O_RDONLY)) < 0) {
+        rb_sys_fail(RSTRING_PTR(path));
+    }
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        rb_sys_fail(RSTRING_PTR(path));
+    }
+    if (st.st_size > 0) {
+        ptr = mmap(0, (size_t) st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (ptr == MAP_FAILED) {
+            close(fd);
+            rb_sys_fail(RSTRING_PTR(path));
+        }
+#if defined(HAVE_MADVISE) && defined(MADV_SEQUENTIAL)
+        madvise(ptr, (size_t) st.st_size, MADV_SEQUENTIAL);
+#endif
+    }
+    close(fd);
+    args[0] = Data_Make_Struct(bz_cInternalMap, struct bz_map, 0, bz_map_free, map);
+    map->ptr = ptr;
+    map->len = (size_t) st.st_size;
+    args[1] = opts;
+    res = rb_funcall2(obj, id_new, NIL_P(opts) ? 1 : 2, args);
+    if (rb_block_given_p()) {
+        return rb_ensure(rb_yield, res, bz_reader_close, res);
+    }
+    return res;
+#else
+    rb_notimplement();
+    return Qnil;
+#endif
+}
+
+/*
+ * call-seq:
+ *    initialize(io, options = {})
  *
  * Creates a new stream for reading a bzip file or string
  *
+ *    Bzip2::Reader.new File.open('file.bz2'), :multistream => true
+ *
  * @param [File, string, #read] io the source for input data. If the source is
  *    a file or something responding to #read, then data will be read via #read,
  *    otherwise if the input is a string it will be taken as the literal data
  *    to decompress
+ * @param [Hash] options
+ * @option options [Boolean] :small (false) use the slower algorithm of
+ *    libbzip2 which needs less memory. For compatibility this may also be
+ *    given as the second argument itself.
+ * @option options [Boolean] :multistream (false) keep on reading when a
+ *    stream ends and more input follows, so concatenated streams (like the
+ *    ones written by +pbzip2+ or Bzip2::ParallelWriter) are read as one.
+ *    Bzip2::Reader#unused is only available at the end of the input then.
+ * @option options [Integer] :read_size the number of bytes asked for with
+ *    each <tt>io.read</tt>. Defaults to a multiple of the file system's block
+ *    size of at least 128k for files, and 64k for pipes, sockets and anything
+ *    else.
+ * @option options [Bzip2::Index] :index the index of the input, which makes
+ *    Bzip2::Reader#seek and Bzip2::Reader#seek_line available. +io+ has to
+ *    respond to +seek+ unless it's a String.
  */
 VALUE bz_reader_init(int argc, VALUE *argv, VALUE obj) {
     struct bz_file *bzf;
     int small = 0;
-    VALUE a, b;
-    int internal = 0;
+    VALUE a, b, index = Qnil;
+    int internal = 0, multi = 0;
+    long iosize = 0;
 
     if (rb_scan_args(argc, argv, "11", &a, &b) == 2) {
-        small = RTEST(b);
+        if (TYPE(b) == T_HASH) {
+            VALUE v;
+
+            small = RTEST(bz_opt(b, "small"));
+            multi = RTEST(bz_opt(b, "multistream")) ? BZ2_RB_MULTISTREAM : 0;
+            if (!NIL_P(v = bz_opt(b, "read_size"))) {
+                iosize = NUM2LONG(v);
+                if (iosize < 1 || iosize > (1 << 30)) {
+                    rb_raise(rb_eArgError, "invalid read size %ld", iosize);
+                }
+            }
+            if (!NIL_P(index = bz_opt(b, "index"))) {
+                bz_index_get(index);
+            }
+        } else {
+            small = RTEST(b);
+        }
     }
     rb_io_taint_check(a);
     if (OBJ_TAINTED(a)) {
@@ -267,14 +667,20 @@ VALUE bz_reader_init(int argc, VALUE *argv, VALUE obj) {
         }
         res = Data_Make_Struct(bz_cInternal, struct bz_str,
             bz_str_mark, free, bzs);
-        bzs->str = a;
+        /* shares the memory of the string, which can't change under us */
+        bzs->str = rb_str_new_frozen(a);
         a = res;
-        internal = BZ2_RB_INTERNAL;
+        internal = BZ2_RB_INTERNAL | BZ2_RB_STRING;
     }
-    Data_Get_Struct(obj, struct bz_file, bzf);
+    Data_Get_BZ2(obj, bzf);
     bzf->io = a;
+    if (rb_obj_is_kind_of(a, bz_cInternalMap)) {
+        internal = BZ2_RB_INTERNAL | BZ2_RB_MAP;
+    }
     bzf->small = small;
-    bzf->flags |= internal;
+    bzf->index = index;
+    bzf->flags |= internal | multi;
+    bzf->iosize = iosize ? (unsigned int) iosize : bz_reader_read_size(a);
     return obj;
 }
 
@@ -316,7 +722,6 @@ VALUE bz_reader_read(int argc, VALUE *argv, VALUE obj) {
         OBJ_TAINT(res);
     }
     if (n == 0) {
-        free(bzf->buf);
         return res;
     }
     while (1) {
@@ -326,27 +731,57 @@ VALUE bz_reader_read(int argc, VALUE *argv, VALUE obj) {
             res = rb_str_cat(res, bzf->bzs.next_out, n);
             bzf->bzs.next_out += n;
             bzf->bzs.avail_out -= n;
-            free(bzf->buf);
             return res;
         }
         if (total) {
             res = rb_str_cat(res, bzf->bzs.next_out, total);
         }
         if (bz_next_available(bzf, 0) == BZ_STREAM_END) {
-            free(bzf->buf);
-            return res;
+            /* like IO#read, read(n) is nil at the end of the data */
+            return n != -1 && !RSTRING_LEN(res) ? Qnil : res;
         }
     }
     return Qnil;
 }
 
+/*
+ * Pushes len bytes back in front of the data that hasn't been read yet,
+ * making room at the start of the buffer if there isn't enough.
+ */
+void bz_reader_unread(struct bz_file *bzf, const char *ptr, unsigned int len) {
+    unsigned int off = (unsigned int)(bzf->bzs.next_out - bzf->buf);
+
+    if (off < len) {
+        if (bzf->buflen < bzf->bzs.avail_out + len) {
+            bzf->buflen = bzf->bzs.avail_out + len;
+            REALLOC_N(bzf->buf, char, bzf->buflen + 1);
+            bzf->buf[bzf->buflen] = '\0';
+            bz_stats_buf(bzf, bzf->buflen);
+        }
+        MEMMOVE(bzf->buf + len, bzf->buf + off, char, bzf->bzs.avail_out);
+        off = len;
+    }
+    bzf->bzs.next_out = bzf->buf + off - len;
+    MEMCPY(bzf->bzs.next_out, ptr, char, len);
+    bzf->bzs.avail_out += len;
+}
+
+/*
+ * The next byte straight out of the buffer, without a string for it, or EOF
+ */
 int bz_getc(VALUE obj) {
-    VALUE length = INT2FIX(1);
-    VALUE res = bz_reader_read(1, &length, obj);
-    if (NIL_P(res) || RSTRING_LEN(res) == 0) {
+    struct bz_file *bzf = bz_get_bzf(obj);
+
+    if (!bzf) {
         return EOF;
     }
-    return RSTRING_PTR(res)[0];
+    while (!bzf->bzs.avail_out) {
+        if (bz_next_available(bzf, 0) == BZ_STREAM_END) {
+            return EOF;
+        }
+    }
+    bzf->bzs.avail_out--;
+    return (unsigned char) *bzf->bzs.next_out++;
 }
 
 /*
@@ -374,22 +809,14 @@ int bz_getc(VALUE obj) {
 VALUE bz_reader_ungetc(VALUE obj, VALUE a) {
     struct bz_file *bzf;
     int c = NUM2INT(a);
+    char ch;
 
     Get_BZ2(obj, bzf);
     if (!bzf->buf) {
         bz_raise(BZ_SEQUENCE_ERROR);
     }
-    if (bzf->bzs.avail_out < bzf->buflen) {
-        bzf->bzs.next_out -= 1;
-        bzf->bzs.next_out[0] = c;
-        bzf->bzs.avail_out += 1;
-    } else {
-        bzf->buf = REALLOC_N(bzf->buf, char, bzf->buflen + 2);
-        bzf->buf[bzf->buflen++] = c;
-        bzf->buf[bzf->buflen] = '\0';
-        bzf->bzs.next_out = bzf->buf;
-        bzf->bzs.avail_out = bzf->buflen;
-    }
+    ch = c;
+    bz_reader_unread(bzf, &ch, 1);
     return Qnil;
 }
 
@@ -423,18 +850,7 @@ VALUE bz_reader_ungets(VALUE obj, VALUE a) {
     if (!bzf->buf) {
         bz_raise(BZ_SEQUENCE_ERROR);
     }
-    if ((bzf->bzs.avail_out + RSTRING_LEN(a)) < bzf->buflen) {
-        bzf->bzs.next_out -= RSTRING_LEN(a);
-        MEMCPY(bzf->bzs.next_out, RSTRING_PTR(a), char, RSTRING_LEN(a));
-        bzf->bzs.avail_out += (int) RSTRING_LEN(a);
-    } else {
-        bzf->buf = REALLOC_N(bzf->buf, char, bzf->buflen + RSTRING_LEN(a) + 1);
-        MEMCPY(bzf->buf + bzf->buflen, RSTRING_PTR(a), char,RSTRING_LEN(a));
-        bzf->buflen += (int) RSTRING_LEN(a);
-        bzf->buf[bzf->buflen] = '\0';
-        bzf->bzs.next_out = bzf->buf;
-        bzf->bzs.avail_out = bzf->buflen;
-    }
+    bz_reader_unread(bzf, RSTRING_PTR(a), (unsigned int) RSTRING_LEN(a));
     return Qnil;
 }
 
@@ -499,7 +915,7 @@ VALUE bz_reader_gets_internal(int argc, VALUE *argv, VALUE obj, int *td, int ini
                 td[i] = rslen + 1;
             }
             for (i = 0; i < rslen; i++) {
-                td[(int)*(rsptr + i)] = rslen - i;
+                td[(unsigned char)*(rsptr + i)] = rslen - i;
             }
         }
         td1 = td;
@@ -527,11 +943,13 @@ VALUE bz_reader_set_unused(VALUE obj, VALUE a) {
 
     Check_Type(a, T_STRING);
     Get_BZ2(obj, bzf);
-    if (!bzf->in) {
+    if (!bzf->in || !bzf->bzs.avail_in) {
         bzf->in = rb_str_new(RSTRING_PTR(a), RSTRING_LEN(a));
     } else {
-        bzf->in = rb_str_cat(bzf->in, RSTRING_PTR(a), RSTRING_LEN(a));
+        bzf->in = rb_str_new(bzf->bzs.next_in, bzf->bzs.avail_in);
+        rb_str_cat(bzf->in, RSTRING_PTR(a), RSTRING_LEN(a));
     }
+    rb_obj_freeze(bzf->in);
     bzf->bzs.next_in = RSTRING_PTR(bzf->in);
     bzf->bzs.avail_in = (int) RSTRING_LEN(bzf->in);
     return Qnil;
@@ -549,14 +967,9 @@ VALUE bz_reader_set_unused(VALUE obj, VALUE a) {
  *    has been reached
  */
 VALUE bz_reader_getc(VALUE obj) {
-    VALUE str;
-    VALUE len = INT2FIX(1);
+    int c = bz_getc(obj);
 
-    str = bz_reader_read(1, &len, obj);
-    if (NIL_P(str) || RSTRING_LEN(str) == 0) {
-        return Qnil;
-    }
-    return INT2FIX(RSTRING_PTR(str)[0] & 0xff);
+    return c == EOF ? Qnil : INT2FIX(c);
 }
 
 void bz_eoz_error() {
@@ -699,7 +1112,7 @@ VALUE bz_reader_each_byte(VALUE obj) {
     int c;
 
     while ((c = bz_getc(obj)) != EOF) {
-        rb_yield(INT2FIX(c & 0xff));
+        rb_yield(INT2FIX(c));
     }
     return obj;
 }
@@ -781,7 +1194,7 @@ VALUE bz_reader_eof(VALUE obj) {
 VALUE bz_reader_closed(VALUE obj) {
     struct bz_file *bzf;
 
-    Data_Get_Struct(obj, struct bz_file, bzf);
+    Data_Get_BZ2(obj, bzf);
     return RTEST(bzf->io)?Qfalse:Qtrue;
 }
 
@@ -801,13 +1214,15 @@ VALUE bz_reader_close(VALUE obj) {
     VALUE res;
 
     Get_BZ2(obj, bzf);
-    if (bzf->buf) {
-        free(bzf->buf);
-        bzf->buf = 0;
-    }
+    bz_buf_release(bzf);
     if (bzf->state == BZ_OK) {
         BZ2_bzDecompressEnd(&(bzf->bzs));
     }
+    bz_mem_report(bzf);
+    if (bzf->pr) {
+        bz_preader_free(bzf->pr);
+        bzf->pr = 0;
+    }
     if (bzf->flags & BZ2_RB_CLOSE) {
         int closed = 0;
         if (rb_respond_to(bzf->io, id_closed)) {
@@ -827,6 +1242,41 @@ VALUE bz_reader_close(VALUE obj) {
     return res;
 }
 
+/*
+ * call-seq:
+ *    reset(io, options = {})
+ *
+ * Closes this reader and starts over on a new stream read from +io+, just
+ * like a new reader created with the same arguments would. The buffer of
+ * this reader is kept and libbzip2 gets its working memory from the pool
+ * (see Bzip2.pool_limit), so this is cheaper than a new reader per message.
+ *
+ *    reader = Bzip2::Reader.new first_message
+ *    reader.read
+ *    reader.reset second_message
+ *    reader.read
+ *
+ * @return [Bzip2::Reader] self
+ * @raise [IOError] if the stream has been closed
+ */
+VALUE bz_reader_reset(int argc, VALUE *argv, VALUE obj) {
+    struct bz_file *bzf;
+
+    Get_BZ2(obj, bzf);
+    bzf->flags |= BZ2_RB_RESET;
+    bz_reader_close(obj);
+    bzf->flags = 0;
+    bzf->state = BZ_OK;
+    bzf->lineno = 0;
+    bzf->decoded = 0;
+    bzf->in = 0;
+    bzf->bzs.next_in = 0;
+    bzf->bzs.avail_in = 0;
+    bzf->bzs.avail_out = 0;
+    rb_funcall2(obj, id_initialize, argc, argv);
+    return obj;
+}
+
 /*
  * Originally undocument and had no sepcs. Appears to call Bzip2::Reader#read
  * and then mark the stream as finished, but this didn't work for me...
@@ -837,9 +1287,8 @@ VALUE bz_reader_finish(VALUE obj) {
     Get_BZ2(obj, bzf);
     if (bzf->buf) {
         rb_funcall2(obj, id_read, 0, 0);
-        free(bzf->buf);
     }
-    bzf->buf = 0;
+    bz_buf_release(bzf);
     bzf->state = BZ_OK;
     return Qnil;
 }
@@ -924,7 +1373,7 @@ VALUE bz_reader_s_foreach(int argc, VALUE *argv, VALUE obj) {
         return Qnil;
     }
     arg.obj = rb_funcall2(obj, id_new, 1, &arg.obj);
-    Data_Get_Struct(arg.obj, struct bz_file, bzf);
+    Data_Get_BZ2(arg.obj, bzf);
     bzf->flags |= BZ2_RB_CLOSE;
     return rb_ensure(bz_reader_foreach_line, (VALUE)&arg, bz_reader_close, arg.obj);
 }
@@ -979,7 +1428,7 @@ VALUE bz_reader_s_readlines(int argc, VALUE *argv, VALUE obj) {
         return Qnil;
     }
     arg.obj = rb_funcall2(obj, id_new, 1, &arg.obj);
-    Data_Get_Struct(arg.obj, struct bz_file, bzf);
+    Data_Get_BZ2(arg.obj, bzf);
     bzf->flags |= BZ2_RB_CLOSE;
     return rb_ensure(bz_reader_i_readlines, (VALUE)&arg, bz_reader_close, arg.obj);
 }
@@ -1030,3 +1479,183 @@ VALUE bz_reader_set_lineno(VALUE obj, VALUE lineno) {
     bzf->lineno = NUM2INT(lineno);
     return lineno;
 }
+
+/*
+ * Positions the io of a reader at byte off of the compressed input
+ */
+void bz_reader_seek_io(struct bz_file *bzf, unsigned long long off) {
+    if (bzf->flags & BZ2_RB_STRING) {
+        struct bz_str *bzs;
+
+        Data_Get_Struct(bzf->io, struct bz_str, bzs);
+        if (off < (unsigned long long) RSTRING_LEN(bzs->str)) {
+            bzs->pos = (long) off;
+        } else {
+            bzs->pos = -1;
+        }
+    } else if (bzf->flags & BZ2_RB_MAP) {
+        struct bz_map *map;
+
+        Data_Get_Struct(bzf->io, struct bz_map, map);
+        map->pos = (size_t) off;
+    } else {
+        rb_funcall(bzf->io, rb_intern("seek"), 1, ULL2NUM(off));
+    }
+    bzf->in = Qnil;
+    bzf->bzs.next_in = 0;
+    bzf->bzs.avail_in = 0;
+}
+
+struct bz_index * bz_reader_index(struct bz_file *bzf) {
+    if (!RTEST(bzf->index)) {
+        rb_raise(rb_eIOError, "no index to seek with");
+    }
+    return bz_index_get(bzf->index);
+}
+
+/*
+ * Starts decoding over at block i of the index, so that the next byte read
+ * is the one at offset off. From here on the input is read block by block,
+ * as a Bzip2::ParallelReader does.
+ */
+void bz_reader_seek_block(VALUE obj, struct bz_file *bzf,
+    struct bz_index *idx, long i, unsigned long long off) {
+    unsigned long long skip = 0;
+
+    if (bzf->bzs.state) {
+        BZ2_bzDecompressEnd(&(bzf->bzs));
+        bz_mem_report(bzf);
+    }
+    if (i < 0) {
+        bz_reader_seek_io(bzf, 0);
+        bz_preader_seek(bzf, 0, 0);
+    } else {
+        skip = off - idx->ents[i].offset;
+        bz_reader_seek_io(bzf, idx->ents[i].bit / 8);
+        bz_preader_seek(bzf, idx->ents[i].bit, skip);
+    }
+    bzf->state = BZ_OK;
+    bz_get_bzf(obj);
+    bzf->bzs.next_out = bzf->buf;
+    bzf->bzs.avail_out = 0;
+    bzf->decoded = off;
+}
+
+/*
+ * call-seq:
+ *    seek(offset)
+ *
+ * Moves to the byte at +offset+ of the decompressed data. Data which has
+ * already been decompressed is skipped over, anything else needs the index
+ * given to Bzip2::Reader#initialize: decompression then starts over at the
+ * block holding +offset+, so at most one block is decompressed in vain.
+ * Reading then goes on up to the end of the input, across streams. With the
+ * index an +offset+ past the end of the data moves to the end.
+ *
+ *    index = Bzip2::Index.build File.open('file.bz2', 'rb')
+ *    reader = Bzip2::Reader.open('file.bz2', :index => index)
+ *    reader.seek 1 << 30
+ *    reader.read 10
+ *
+ * @param [Integer] offset the position in the decompressed data
+ * @return [Integer] 0
+ * @raise [IOError] if the stream has been closed or has no index
+ */
+VALUE bz_reader_seek(VALUE obj, VALUE offset) {
+    struct bz_file *bzf;
+    struct bz_index *idx;
+    unsigned long long off, pos;
+
+    Get_BZ2(obj, bzf);
+    if (NUM2LL(offset) < 0) {
+        rb_raise(rb_eArgError, "negative offset given");
+    }
+    off = NUM2ULL(offset);
+    pos = bzf->decoded - bzf->bzs.avail_out;
+    if (bzf->buf && off >= pos && off <= bzf->decoded) {
+        bzf->bzs.next_out += off - pos;
+        bzf->bzs.avail_out -= (unsigned int) (off - pos);
+        return INT2FIX(0);
+    }
+    idx = bz_reader_index(bzf);
+    if (off > idx->size) {
+        off = idx->size;
+    }
+    bz_reader_seek_block(obj, bzf, idx, bz_index_find(idx, off), off);
+    return INT2FIX(0);
+}
+
+/*
+ * call-seq:
+ *    seek_line(line)
+ *
+ * Moves to the start of line number +line+ (counting from 0, lines end in
+ * "\n") with the help of the index given to Bzip2::Reader#initialize, and
+ * sets Bzip2::Reader#lineno to it.
+ *
+ *    reader = Bzip2::Reader.open('file.bz2', :index => index)
+ *    reader.seek_line 1_000_000
+ *    reader.gets
+ *
+ * @param [Integer] line the number of the line
+ * @return [Integer] 0
+ * @raise [IOError] if the stream has been closed or has no index
+ */
+VALUE bz_reader_seek_line(VALUE obj, VALUE line) {
+    struct bz_file *bzf;
+    struct bz_index *idx;
+    unsigned long long n, k = 0;
+    unsigned int len;
+    char *p;
+    long i;
+
+    Get_BZ2(obj, bzf);
+    if (NUM2LL(line) < 0) {
+        rb_raise(rb_eArgError, "negative line given");
+    }
+    n = NUM2ULL(line);
+    idx = bz_reader_index(bzf);
+    i = bz_index_find_line(idx, n);
+    if (i < 0) {
+        bz_reader_seek_block(obj, bzf, idx, i, 0);
+    } else {
+        bz_reader_seek_block(obj, bzf, idx, i, idx->ents[i].offset);
+        if (idx->ents[i].line < n) {
+            k = n - idx->ents[i].line;
+        }
+    }
+    while (k) {
+        if (!bzf->bzs.avail_out && bz_next_available(bzf, 0) == BZ_STREAM_END) {
+            break;
+        }
+        p = memchr(bzf->bzs.next_out, '\n', bzf->bzs.avail_out);
+        if (p) {
+            len = (unsigned int) (p + 1 - bzf->bzs.next_out);
+            k--;
+        } else {
+            len = bzf->bzs.avail_out;
+        }
+        bzf->bzs.next_out += len;
+        bzf->bzs.avail_out -= len;
+    }
+    bzf->lineno = (int) n;
+    return INT2FIX(0);
+}
+
+/*
+ * call-seq:
+ *    pos -> Integer
+ *
+ * @return [Integer] the position in the decompressed data, the number of
+ *    bytes read so far unless Bzip2::Reader#seek was used
+ * @raise [IOError] if the stream has been closed
+ */
+VALUE bz_reader_pos(VALUE obj) {
+    struct bz_file *bzf;
+
+    Get_BZ2(obj, bzf);
+    if (bzf->bzs.avail_out > bzf->decoded) {
+        return INT2FIX(0);
+    }
+    return ULL2NUM(bzf->decoded - bzf->bzs.avail_out);
+}
@@ -2,6 +2,7 @@
 #define _RB_BZIP2_READER_H_
 
 #include <ruby.h>
+#include "common.h"
 
 /* Instance methods */
 VALUE bz_reader_init(int argc, VALUE *argv, VALUE obj);
@@ -23,12 +24,20 @@ VALUE bz_reader_closed(VALUE obj);
 VALUE bz_reader_close(VALUE obj);
 VALUE bz_reader_close_bang(VALUE obj);
 VALUE bz_reader_finish(VALUE obj);
+VALUE bz_reader_reset(int argc, VALUE *argv, VALUE obj);
 VALUE bz_reader_lineno(VALUE obj);
 VALUE bz_reader_set_lineno(VALUE obj, VALUE lineno);
+VALUE bz_reader_seek(VALUE obj, VALUE offset);
+VALUE bz_reader_seek_line(VALUE obj, VALUE line);
+VALUE bz_reader_pos(VALUE obj);
+
+void bz_reader_free(struct bz_file *bzf);
+VALUE bz_map_read(int argc, VALUE *argv, VALUE obj);
 
 /* Class methods */
 VALUE bz_reader_s_alloc(VALUE obj);
 VALUE bz_reader_s_open(int argc, VALUE *argv, VALUE obj);
+VALUE bz_reader_s_mmap(int argc, VALUE *argv, VALUE obj);
 VALUE bz_reader_s_foreach(int argc, VALUE *argv, VALUE obj);
 VALUE bz_reader_s_readlines(int argc, VALUE *argv, VALUE obj);
 
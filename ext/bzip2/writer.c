@@ -2,107 +2,200 @@
 #include <unistd.h>
 #include "common.h"
 #include "writer.h"
+#include "parallel.h"
+#include "index.h"
+#include "probes.h"
 
-struct bz_iv * bz_find_struct(VALUE obj, void *ptr, int *posp) {
-    struct bz_iv *bziv;
-    int i;
+/*
+ * Writers with an io are registered by it, which makes sure an io has a
+ * single writer and lets the writers which weren't closed be flushed at
+ * exit. The registry doesn't keep them alive: a writer which is collected
+ * only clears its entry (the garbage collector mustn't change the table),
+ * and cleared entries are dropped later on by bz_iv_register.
+ */
+st_index_t bz_internal_purge_at = 64;
 
-    for (i = 0; i < RARRAY_LEN(bz_internal_ary); i++) {
-        Data_Get_Struct(RARRAY_PTR(bz_internal_ary)[i], struct bz_iv, bziv);
-        if (ptr) {
-#ifndef RUBY_19_COMPATIBILITY
-            if (TYPE(bziv->io) == T_FILE && RFILE(bziv->io)->fptr == (OpenFile *)ptr) {
-#else
-            if (TYPE(bziv->io) == T_FILE && RFILE(bziv->io)->fptr == (rb_io_t *)ptr) {
-#endif
-                if (posp) {
-                    *posp = i;
-                }
-                return bziv;
-            } else if (TYPE(bziv->io) == T_DATA && DATA_PTR(bziv->io) == ptr) {
-                    if (posp) *posp = i;
-                    return bziv;
-            }
-        } else if (bziv->io == obj) {
-            if (posp) *posp = i;
-            return bziv;
-        }
+struct bz_iv * bz_find_struct(VALUE io) {
+    st_data_t bziv;
+
+    if (st_lookup(bz_internal_ios, (st_data_t) io, &bziv) &&
+        !NIL_P(((struct bz_iv *) bziv)->bz2)) {
+        return (struct bz_iv *) bziv;
     }
-    if (posp) *posp = -1;
     return 0;
 }
 
-VALUE bz_str_closed(VALUE obj) {
-    return Qfalse;
+int bz_iv_purge_i(st_data_t key, st_data_t bziv, st_data_t arg) {
+    if (NIL_P(((struct bz_iv *) bziv)->bz2)) {
+        free((struct bz_iv *) bziv);
+        return ST_DELETE;
+    }
+    return ST_CONTINUE;
 }
 
-void bz_io_data_finalize(void *ptr) {
+void bz_iv_register(struct bz_iv *bziv) {
+    st_data_t key = (st_data_t) bziv->io, old;
+
+    if (bz_internal_ios->num_entries >= bz_internal_purge_at) {
+        st_foreach(bz_internal_ios, bz_iv_purge_i, 0);
+        bz_internal_purge_at = 2 * bz_internal_ios->num_entries + 64;
+    }
+    /* a cleared entry of a collected io whose VALUE got reused */
+    if (st_delete(bz_internal_ios, &key, &old)) {
+        free((struct bz_iv *) old);
+    }
+    st_insert(bz_internal_ios, (st_data_t) bziv->io, (st_data_t) bziv);
+}
+
+void bz_iv_unregister(struct bz_iv *bziv) {
+    st_data_t key = (st_data_t) bziv->io;
+
+    st_delete(bz_internal_ios, &key, 0);
+    free(bziv);
+}
+
+struct bz_compress_arg {
     struct bz_file *bzf;
-    struct bz_iv *bziv;
-    int pos;
-
-    bziv = bz_find_struct(0, ptr, &pos);
-    if (bziv) {
-        rb_ary_delete_at(bz_internal_ary, pos);
-        Data_Get_Struct(bziv->bz2, struct bz_file, bzf);
-        rb_protect((VALUE (*)(VALUE))bz_writer_internal_flush, (VALUE)bzf, 0);
-        RDATA(bziv->bz2)->dfree = free;
-        if (bziv->finalize) {
-            (*bziv->finalize)(ptr);
-        } else if (TYPE(bzf->io) == T_FILE) {
-#ifndef RUBY_19_COMPATIBILITY
-            OpenFile *file = (OpenFile *)ptr;
-            if (file->f) {
-                fclose(file->f);
-                file->f = 0;
-            }
-            if (file->f2) {
-                fclose(file->f2);
-                file->f2 = 0;
-            }
-#else
-            rb_io_t *file = (rb_io_t *)ptr;
-            if (file->fd) {
-                close(file->fd);
+    int action;
+    int state;
+    unsigned long calls;
+    double time;
+    volatile int interrupted;
+};
 
-                file->fd = 0;
-            }
-            if (file->stdio_file) {
-                fclose(file->stdio_file);
-                file->stdio_file = 0;
-            }
-#endif
+/*
+ * Called without the GVL. libbzip2 can't be stopped in the middle of sorting
+ * a block, so for BZ_RUN the input is handed over one block at a time which
+ * gives the unblocking function a chance to stop us in between.
+ */
+void * bz_writer_compress_i(void *ptr) {
+    struct bz_compress_arg *arg = ptr;
+    bz_stream *bzs = &(arg->bzf->bzs);
+    unsigned int left, slice;
+    double start = bz_now();
+
+    if (arg->action != BZ_RUN) {
+        arg->state = BZ2_bzCompress(bzs, arg->action);
+        arg->calls = 1;
+        arg->time = bz_now() - start;
+        return 0;
+    }
+    slice = arg->bzf->blocks * 100000;
+    do {
+        left = bzs->avail_in;
+        if (left > slice) {
+            bzs->avail_in = slice;
+        } else {
+            slice = left;
+        }
+        arg->state = BZ2_bzCompress(bzs, BZ_RUN);
+        arg->calls++;
+        bzs->avail_in += left - slice;
+    } while (arg->state == BZ_RUN_OK && bzs->avail_in && bzs->avail_out &&
+             !arg->interrupted);
+    arg->time = bz_now() - start;
+    return 0;
+}
+
+void bz_writer_compress_ubf(void *ptr) {
+    ((struct bz_compress_arg *)ptr)->interrupted = 1;
+}
+
+/*
+ * Runs BZ2_bzCompress over the current next_in/next_out of the stream with
+ * the GVL released and returns the libbzip2 status.
+ */
+int bz_writer_compress(struct bz_file *bzf, int action) {
+    struct bz_compress_arg arg;
+    unsigned int in = bzf->bzs.avail_in, out = bzf->bzs.avail_out;
+
+    arg.bzf = bzf;
+    arg.action = action;
+    arg.state = BZ_OK;
+    arg.calls = 0;
+    arg.time = 0;
+    arg.interrupted = 0;
+    BZ_PROBE2(compress__start, in, action);
+    bz_blocking_call(bzf, bz_writer_compress_i, &arg,
+        bz_writer_compress_ubf, &arg);
+    bz_stats_lib(bzf, arg.calls, in - bzf->bzs.avail_in,
+        out - bzf->bzs.avail_out, arg.time);
+    BZ_PROBE2(compress__done, in - bzf->bzs.avail_in,
+        out - bzf->bzs.avail_out);
+    return arg.state;
+}
+
+/*
+ * Hands the compressed data collected in bzf->buf over to the io in a
+ * single write and starts over at the beginning of the buffer. A plain File
+ * is written to with write(2) on its descriptor, the string of a writer
+ * without an io is appended to.
+ */
+void bz_writer_write_out(struct bz_file *bzf) {
+    unsigned int n = bzf->buflen - bzf->bzs.avail_out;
+    long done = 0;
+    double start;
+    int fd;
+
+    if (n && (bzf->flags & BZ2_RB_INTERNAL)) {
+        rb_str_cat(bzf->io, bzf->buf, n);
+    } else if (n) {
+        BZ_PROBE1(io__write__start, n);
+        start = bz_now();
+        if ((fd = bz_io_fd(bzf->io, 1)) >= 0) {
+            done = bz_fd_write(bzf, fd, bzf->buf, n);
+        }
+        if (done < n) {
+            rb_funcall(bzf->io, id_write, 1,
+                rb_str_new(bzf->buf + done, n - done));
         }
+        bz_stats_io(bzf, 1, start);
+        BZ_PROBE1(io__write__done, n);
     }
+    bzf->written += n;
+    bzf->bzs.next_out = bzf->buf;
+    bzf->bzs.avail_out = bzf->buflen;
+}
 
+/*
+ * Compresses what's left of the current stream and writes all of it out
+ */
+void bz_writer_finish(struct bz_file *bzf) {
+    bzf->bzs.next_in = NULL;
+    bzf->bzs.avail_in = 0;
+    do {
+        bzf->state = bz_writer_compress(bzf, BZ_FINISH);
+        if (bzf->state != BZ_FINISH_OK && bzf->state != BZ_STREAM_END) {
+            break;
+        }
+        bz_writer_write_out(bzf);
+    } while (bzf->state != BZ_STREAM_END);
+    if (bzf->state == BZ_STREAM_END) {
+        BZ_PROBE2(stream__end, BZ_TOTAL_IN(&bzf->bzs), BZ_TOTAL_OUT(&bzf->bzs));
+    }
 }
 
 int bz_writer_internal_flush(struct bz_file *bzf) {
     int closed = 1;
 
-    if (rb_respond_to(bzf->io, id_closed)) {
+    if (bzf->flags & BZ2_RB_INTERNAL) {
+        closed = NIL_P(bzf->io);
+    } else if (rb_respond_to(bzf->io, id_closed)) {
         closed = RTEST(rb_funcall2(bzf->io, id_closed, 0, 0));
     }
+    if (bzf->pw) {
+        bz_pwriter_flush(bzf, closed);
+        return closed;
+    }
     if (bzf->buf) {
         if (!closed && bzf->state == BZ_OK) {
-            bzf->bzs.next_in = NULL;
-            bzf->bzs.avail_in = 0;
-            do {
-                bzf->bzs.next_out = bzf->buf;
-                bzf->bzs.avail_out = bzf->buflen;
-                bzf->state = BZ2_bzCompress(&(bzf->bzs), BZ_FINISH);
-                if (bzf->state != BZ_FINISH_OK && bzf->state != BZ_STREAM_END) {
-                    break;
-                }
-                if (bzf->bzs.avail_out < bzf->buflen) {
-                    rb_funcall(bzf->io, id_write, 1, rb_str_new(bzf->buf, bzf->buflen - bzf->bzs.avail_out));
-                }
-            } while (bzf->state != BZ_STREAM_END);
+            bz_writer_finish(bzf);
         }
-        free(bzf->buf);
-        bzf->buf = 0;
+        bz_buf_release(bzf);
         BZ2_bzCompressEnd(&(bzf->bzs));
+        bz_mem_report(bzf);
         bzf->state = BZ_OK;
+        bzf->streamlen = 0;
         if (!closed && rb_respond_to(bzf->io, id_flush)) {
             rb_funcall2(bzf->io, id_flush, 0, 0);
         }
@@ -111,21 +204,13 @@ int bz_writer_internal_flush(struct bz_file *bzf) {
 }
 
 VALUE bz_writer_internal_close(struct bz_file *bzf) {
-    struct bz_iv *bziv;
-    int pos, closed;
+    int closed;
     VALUE res;
 
     closed = bz_writer_internal_flush(bzf);
-    bziv = bz_find_struct(bzf->io, 0, &pos);
-    if (bziv) {
-        if (TYPE(bzf->io) == T_FILE) {
-            RFILE(bzf->io)->fptr->finalize = bziv->finalize;
-        } else if (TYPE(bziv->io) == T_DATA) {
-            RDATA(bziv->io)->dfree = bziv->finalize;
-        }
-        RDATA(bziv->bz2)->dfree = free;
-        bziv->bz2 = 0;
-        rb_ary_delete_at(bz_internal_ary, pos);
+    if (bzf->iv) {
+        bz_iv_unregister(bzf->iv);
+        bzf->iv = 0;
     }
     if (bzf->flags & BZ2_RB_CLOSE) {
         bzf->flags &= ~BZ2_RB_CLOSE;
@@ -157,15 +242,50 @@ VALUE bz_writer_internal_close(struct bz_file *bzf) {
  */
 VALUE bz_writer_close(VALUE obj) {
     struct bz_file *bzf;
-    VALUE res;
 
     Get_BZ2(obj, bzf);
-    res = bz_writer_internal_close(bzf);
-#ifndef RUBINIUS
-    if (!NIL_P(res) && (bzf->flags & BZ2_RB_INTERNAL)) {
-        RBASIC(res)->klass = rb_cString;
-    }
-#endif
+    return bz_writer_internal_close(bzf);
+}
+
+/*
+ * call-seq:
+ *    reset(io = nil)
+ *
+ * Finishes the current stream, just like Bzip2::Writer#close, and starts a
+ * new one written to +io+ (or to a new string if +io+ is nil) with the same
+ * settings. The buffer of this writer is kept and libbzip2 gets its working
+ * memory from the pool (see Bzip2.pool_limit), so this is cheaper than a
+ * new writer per message.
+ *
+ *    writer = Bzip2::Writer.new
+ *    messages.each do |message|
+ *      queue.push((writer << message).reset)
+ *    end
+ *
+ * @return [String, IO, nil] what Bzip2::Writer#close returned for the
+ *    finished stream
+ * @raise [IOError] if the stream has been closed
+ */
+VALUE bz_writer_reset(int argc, VALUE *argv, VALUE obj) {
+    struct bz_file *bzf;
+    VALUE io, res, index;
+    int blocks, work;
+    unsigned int iosize;
+
+    rb_scan_args(argc, argv, "01", &io);
+    Get_BZ2(obj, bzf);
+    blocks = bzf->blocks;
+    work = bzf->work;
+    iosize = bzf->iosize;
+    index = NIL_P(bzf->index) ? Qnil : ULONG2NUM(bzf->streamsize);
+    bzf->flags |= BZ2_RB_RESET;
+    res = bz_writer_close(obj);
+    bzf->flags &= ~(BZ2_RB_RESET | BZ2_RB_INTERNAL);
+    bz_writer_init(NIL_P(io) ? 0 : 1, &io, obj);
+    bzf->blocks = blocks;
+    bzf->work = work;
+    bzf->iosize = iosize;
+    bz_writer_index_opt(bzf, index);
     return res;
 }
 
@@ -198,15 +318,61 @@ VALUE bz_writer_close_bang(VALUE obj) {
 VALUE bz_writer_closed(VALUE obj) {
   struct bz_file *bzf;
 
-  Data_Get_Struct(obj, struct bz_file, bzf);
+  Data_Get_BZ2(obj, bzf);
   return RTEST(bzf->io)?Qfalse:Qtrue;
 }
 
+/*
+ * Frees the memory of a writer without flushing it: the io can't be called
+ * from within the garbage collector, so whatever wasn't written yet is lost
+ * for a writer which wasn't closed.
+ */
 void bz_writer_free(struct bz_file *bzf) {
-    bz_writer_internal_close(bzf);
+    if (bzf->iv) {
+        bzf->iv->bz2 = Qnil;
+    }
+    if (bzf->pw) {
+        bz_pwriter_free(bzf->pw);
+    }
+    if (bzf->bzs.state) {
+        BZ2_bzCompressEnd(&(bzf->bzs));
+    }
+    bz_mem_report(bzf);
+    bzf->flags &= ~BZ2_RB_RESET;
+    bz_buf_release(bzf);
     free(bzf);
 }
 
+#ifdef HAVE_RB_GC_LOCATION
+/*
+ * Compaction can move a writer, whose entry in the registry isn't seen by
+ * the garbage collector. The io stays put, bz_file_mark pins it.
+ */
+void bz_writer_compact(void *ptr) {
+    struct bz_file *bzf = ptr;
+
+    if (bzf->iv) {
+        bzf->iv->bz2 = rb_gc_location(bzf->iv->bz2);
+    }
+}
+#endif
+
+#ifdef HAVE_RB_DATA_TYPE_T_PARENT
+const rb_data_type_t bz_writer_type = {
+    "Bzip2::Writer",
+    {(RUBY_DATA_FUNC)bz_file_mark, (RUBY_DATA_FUNC)bz_writer_free,
+        bz_file_memsize,
+#ifdef HAVE_RB_GC_LOCATION
+        bz_writer_compact,
+#endif
+    },
+    &bz_file_type, 0,
+#ifdef RUBY_TYPED_FREE_IMMEDIATELY
+    RUBY_TYPED_FREE_IMMEDIATELY
+#endif
+};
+#endif
+
 /*
  * Internally allocates information about a new writer
  * @private
@@ -214,10 +380,16 @@ void bz_writer_free(struct bz_file *bzf) {
 VALUE bz_writer_s_alloc(VALUE obj) {
     struct bz_file *bzf;
     VALUE res;
+#ifdef HAVE_RB_DATA_TYPE_T_PARENT
+    res = TypedData_Make_Struct(obj, struct bz_file, &bz_writer_type, bzf);
+#else
     res = Data_Make_Struct(obj, struct bz_file, bz_file_mark, bz_writer_free, bzf);
+#endif
     bzf->bzs.bzalloc = bz_malloc;
     bzf->bzs.bzfree = bz_free;
+    bzf->bzs.opaque = bzf;
     bzf->blocks = DEFAULT_BLOCKS;
+    bzf->iosize = BZ_RB_WRITESIZE;
     bzf->state = BZ_OK;
     return res;
 }
@@ -280,7 +452,7 @@ VALUE bz_writer_s_open(int argc, VALUE *argv, VALUE obj) {
         argc -= 1;
     }
     res = rb_funcall2(obj, id_new, argc, argv);
-    Data_Get_Struct(res, struct bz_file, bzf);
+    Data_Get_BZ2(res, bzf);
     bzf->flags |= BZ2_RB_CLOSE;
     if (rb_block_given_p()) {
         return rb_ensure(rb_yield, res, bz_writer_close, res);
@@ -288,21 +460,27 @@ VALUE bz_writer_s_open(int argc, VALUE *argv, VALUE obj) {
     return res;
 }
 
-VALUE bz_str_write(VALUE obj, VALUE str) {
-    if (TYPE(str) != T_STRING) {
-        rb_raise(rb_eArgError, "expected a String");
-    }
-    if (RSTRING_LEN(str)) {
-        rb_str_cat(obj, RSTRING_PTR(str), RSTRING_LEN(str));
-    }
-    return str;
-}
-
 /*
  * call-seq:
- *    initialize(io = nil)
+ *    initialize(io = nil, blocks = 9, work = 0, options = {})
  *
  * @param [File] io the file which to write compressed data to
+ * @param [Hash] options
+ * @option options [Integer] :blocks (9) the block size (1-9), same as the
+ *    +blocks+ argument
+ * @option options [Integer] :work (0) the work factor, same as the +work+
+ *    argument
+ * @option options [Integer] :size_hint the expected number of bytes to be
+ *    written. Unless a block size is given, it becomes the smallest
+ *    one which holds that much in a single block, which saves memory for
+ *    small streams.
+ * @option options [Integer] :buffer_size (64k) compressed data is collected
+ *    until this many bytes are ready and then handed to <tt>io.write</tt> at
+ *    once. Larger sizes mean fewer (and larger) writes.
+ * @option options [Integer, true] :index a new bzip2 stream is started
+ *    every this many bytes of data (+true+ for every ten blocks), and where
+ *    each one starts is recorded in Bzip2::Writer#index for seeking. The
+ *    streams are concatenated, read them with <tt>:multistream => true</tt>.
  *
  * Creates a new Bzip2::Writer for compressing a stream of data. An optional
  * io object (something responding to +write+) can be supplied which data
@@ -311,6 +489,11 @@ VALUE bz_str_write(VALUE obj, VALUE str) {
  * If nothing is given, the Bzip2::Writer#flush method can be called to retrieve
  * the compressed stream so far.
  *
+ * A writer has to be closed (or be given a block with Bzip2::Writer.open) for
+ * all of the data to reach its io. A writer which is garbage collected loses
+ * what it hadn't written yet; those of the main Ractor which are still
+ * around at exit are flushed then.
+ *
  *    writer = Bzip2::Writer.new File.open('files.bz2')
  *    writer << 'a'
  *    writer << 'b'
@@ -319,13 +502,24 @@ VALUE bz_str_write(VALUE obj, VALUE str) {
  *    writer = Bzip2::Writer.new
  *    writer << 'abcde'
  *    writer.flush # => 'abcde' compressed
+ *
+ *    writer = Bzip2::Writer.new File.open('files.bz2'), :buffer_size => 4 << 20
+ *
+ *    writer = Bzip2::Writer.new File.open('file.bz2', 'wb'), :index => 8 << 20
+ *    writer << data
+ *    File.open('file.bz2.idx', 'wb') { |f| f << writer.index.dump }
+ *    writer.close
  */
 VALUE bz_writer_init(int argc, VALUE *argv, VALUE obj) {
     struct bz_file *bzf;
     int blocks = DEFAULT_BLOCKS;
     int work = 0;
-    VALUE a, b, c;
+    unsigned int iosize = BZ_RB_WRITESIZE;
+    VALUE a, b, c, opts = Qnil;
 
+    if (argc > 0 && TYPE(argv[argc - 1]) == T_HASH) {
+        opts = argv[--argc];
+    }
     switch(rb_scan_args(argc, argv, "03", &a, &b, &c)) {
         case 3:
         work = NUM2INT(c);
@@ -333,11 +527,24 @@ VALUE bz_writer_init(int argc, VALUE *argv, VALUE obj) {
         case 2:
         blocks = NUM2INT(b);
     }
-    Data_Get_Struct(obj, struct bz_file, bzf);
+    if (!NIL_P(b = bz_opt(opts, "blocks"))) {
+        blocks = NUM2INT(b);
+    } else if (argc < 2 && !NIL_P(b = bz_opt(opts, "size_hint"))) {
+        blocks = bz_auto_blocks(NUM2ULONG(b));
+    }
+    if (!NIL_P(c = bz_opt(opts, "work"))) {
+        work = NUM2INT(c);
+    }
+    if (!NIL_P(b = bz_opt(opts, "buffer_size"))) {
+        if (NUM2LONG(b) < 1 || NUM2LONG(b) > (1 << 30)) {
+            rb_raise(rb_eArgError, "invalid buffer size %ld", NUM2LONG(b));
+        }
+        iosize = (unsigned int) NUM2LONG(b);
+    }
+    Data_Get_BZ2(obj, bzf);
     if (NIL_P(a)) {
-        a = rb_str_new(0, 0);
-        rb_define_method(rb_singleton_class(a), "write", bz_str_write, 1);
-        rb_define_method(rb_singleton_class(a), "closed?", bz_str_closed, 0);
+        /* a plain string, appended to directly by bz_writer_write_out */
+        a = rb_str_buf_new(0);
         bzf->flags |= BZ2_RB_INTERNAL;
     } else {
         VALUE iv;
@@ -361,35 +568,120 @@ VALUE bz_writer_init(int argc, VALUE *argv, VALUE obj) {
                 rb_raise(rb_eArgError, "closed object");
             }
         }
-        bziv = bz_find_struct(a, 0, 0);
-        if (bziv) {
-            if (RTEST(bziv->bz2)) {
+        if (bz_main_ractor_p()) {
+            if (bz_find_struct(a)) {
                 rb_raise(rb_eArgError, "invalid data type");
             }
-            bziv->bz2 = obj;
-        } else {
-            iv = Data_Make_Struct(rb_cData, struct bz_iv, 0, free, bziv);
+            bziv = ALLOC(struct bz_iv);
             bziv->io = a;
             bziv->bz2 = obj;
-            rb_ary_push(bz_internal_ary, iv);
-        }
-        switch (TYPE(a)) {
-            case T_FILE:
-                bziv->finalize = RFILE(a)->fptr->finalize;
-                RFILE(a)->fptr->finalize = (void (*)(struct rb_io_t *, int))bz_io_data_finalize;
-                break;
-            case T_DATA:
-                bziv->finalize = RDATA(a)->dfree;
-                RDATA(a)->dfree = bz_io_data_finalize;
-                break;
+            bz_iv_register(bziv);
+            bzf->iv = bziv;
         }
     }
     bzf->io = a;
     bzf->blocks = blocks;
     bzf->work = work;
+    bzf->iosize = iosize;
+    bzf->written = 0;
+    bzf->streamlen = 0;
+    bz_writer_index_opt(bzf, bz_opt(opts, "index"));
     return obj;
 }
 
+/*
+ * Sets up the Bzip2::Index filled in while writing, for the :index option
+ */
+void bz_writer_index_opt(struct bz_file *bzf, VALUE v) {
+    bzf->index = Qnil;
+    bzf->streamsize = 0;
+    if (!RTEST(v)) {
+        return;
+    }
+    if (v == Qtrue) {
+        bzf->streamsize = bzf->blocks * 1000000;
+    } else {
+        if (NUM2LONG(v) < 1) {
+            rb_raise(rb_eArgError, "invalid stream size %ld", NUM2LONG(v));
+        }
+        bzf->streamsize = NUM2ULONG(v);
+    }
+    bzf->index = bz_index_s_alloc(bz_cIndex);
+}
+
+/*
+ * call-seq:
+ *    index -> Bzip2::Index
+ *
+ * The index of what has been written so far, if the writer was created
+ * with the :index option. It's complete once the writer has been closed,
+ * and offsets count from where the writer started writing to its io.
+ *
+ *    writer = Bzip2::Writer.new File.open('file.bz2', 'wb'), :index => true
+ *    writer << data
+ *    writer.close
+ *    reader = Bzip2::Reader.open('file.bz2', :index => writer.index)
+ *
+ * @return [Bzip2::Index, nil] the index, or nil without the :index option
+ */
+VALUE bz_writer_index(VALUE obj) {
+    struct bz_file *bzf;
+
+    Data_Get_BZ2(obj, bzf);
+    return bzf->index;
+}
+
+/*
+ * Starts a new stream, keeping the buffer of the last one if there is one
+ */
+void bz_writer_start(struct bz_file *bzf) {
+    if (bzf->state != BZ_OK) {
+        bz_raise(bzf->state);
+    }
+    bzf->state = BZ2_bzCompressInit(&(bzf->bzs), bzf->blocks,
+        0, bzf->work);
+    if (bzf->state != BZ_OK) {
+        bz_writer_internal_flush(bzf);
+        bz_raise(bzf->state);
+    }
+    if (!bzf->buf) {
+        bzf->buflen = bzf->iosize;
+        bzf->buf = bz_buf_alloc(bzf, &bzf->buflen);
+        bzf->buf[0] = bzf->buf[bzf->buflen] = '\0';
+    }
+    bzf->bzs.next_out = bzf->buf;
+    bzf->bzs.avail_out = bzf->buflen;
+}
+
+/*
+ * How much of len bytes go into the current stream of an indexed writer.
+ * A full stream is finished first and a new one is recorded in the index:
+ * its first block comes right after the 4 byte header.
+ */
+unsigned long bz_writer_index_room(struct bz_file *bzf, unsigned long len) {
+    struct bz_index *idx = bz_index_get(bzf->index);
+
+    if (bzf->streamlen == bzf->streamsize) {
+        bz_writer_finish(bzf);
+        if (bzf->state != BZ_STREAM_END) {
+            bz_writer_internal_flush(bzf);
+            bz_raise(bzf->state);
+        }
+        BZ2_bzCompressEnd(&(bzf->bzs));
+        bzf->state = BZ_OK;
+        bzf->streamlen = 0;
+        bz_writer_start(bzf);
+    }
+    if (!bzf->streamlen) {
+        bz_index_push(idx, bzf->written * 8 + 32);
+    }
+    if (len > bzf->streamsize - bzf->streamlen) {
+        len = bzf->streamsize - bzf->streamlen;
+    }
+    bzf->streamlen += len;
+    return len;
+}
+
 /*
  * call-seq:
  *    write(data)
@@ -401,39 +693,43 @@ VALUE bz_writer_init(int argc, VALUE *argv, VALUE obj) {
  */
 VALUE bz_writer_write(VALUE obj, VALUE a) {
     struct bz_file *bzf;
-    int n;
+    char *ptr;
+    unsigned long len, n;
 
-    a = rb_obj_as_string(a);
+    /* a frozen snapshot can't change under us while the GVL is released */
+    a = rb_str_new_frozen(rb_obj_as_string(a));
     Get_BZ2(obj, bzf);
+    if (bzf->pw) {
+        return bz_pwriter_write(bzf, a);
+    }
     if (!bzf->buf) {
-        if (bzf->state != BZ_OK) {
-            bz_raise(bzf->state);
-        }
-        bzf->state = BZ2_bzCompressInit(&(bzf->bzs), bzf->blocks,
-            0, bzf->work);
-        if (bzf->state != BZ_OK) {
-            bz_writer_internal_flush(bzf);
-            bz_raise(bzf->state);
-        }
-        bzf->buf = ALLOC_N(char, BZ_RB_BLOCKSIZE + 1);
-        bzf->buflen = BZ_RB_BLOCKSIZE;
-        bzf->buf[0] = bzf->buf[bzf->buflen] = '\0';
+        bz_writer_start(bzf);
     }
-    bzf->bzs.next_in  = RSTRING_PTR(a);
-    bzf->bzs.avail_in = (int) RSTRING_LEN(a);
-    while (bzf->bzs.avail_in) {
-        bzf->bzs.next_out = bzf->buf;
-        bzf->bzs.avail_out = bzf->buflen;
-        bzf->state = BZ2_bzCompress(&(bzf->bzs), BZ_RUN);
-        if (bzf->state == BZ_SEQUENCE_ERROR || bzf->state == BZ_PARAM_ERROR) {
-            bz_writer_internal_flush(bzf);
-            bz_raise(bzf->state);
+    ptr = RSTRING_PTR(a);
+    len = RSTRING_LEN(a);
+    while (len) {
+        n = len;
+        if (!NIL_P(bzf->index)) {
+            n = bz_writer_index_room(bzf, n);
+            bz_index_add(bz_index_get(bzf->index), ptr, n);
         }
-        bzf->state = BZ_OK;
-        if (bzf->bzs.avail_out < bzf->buflen) {
-            n = bzf->buflen - bzf->bzs.avail_out;
-            rb_funcall(bzf->io, id_write, 1, rb_str_new(bzf->buf, n));
+        bzf->bzs.next_in = ptr;
+        bzf->bzs.avail_in = (unsigned int) n;
+        while (bzf->bzs.avail_in) {
+            /* output piles up in bzf->buf and only goes out once it is full */
+            bzf->state = bz_writer_compress(bzf, BZ_RUN);
+            if (bzf->state == BZ_SEQUENCE_ERROR ||
+                bzf->state == BZ_PARAM_ERROR) {
+                bz_writer_internal_flush(bzf);
+                bz_raise(bzf->state);
+            }
+            bzf->state = BZ_OK;
+            if (!bzf->bzs.avail_out) {
+                bz_writer_write_out(bzf);
+            }
         }
+        ptr += n;
+        len -= n;
     }
     return INT2NUM(RSTRING_LEN(a));
 }
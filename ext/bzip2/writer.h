@@ -5,6 +5,16 @@
 #include "common.h"
 
 int bz_writer_internal_flush(struct bz_file *bzf);
+void bz_writer_finish(struct bz_file *bzf);
+void bz_writer_start(struct bz_file *bzf);
+void bz_writer_index_opt(struct bz_file *bzf, VALUE v);
+struct bz_iv * bz_find_struct(VALUE io);
+void bz_iv_register(struct bz_iv *bziv);
+void bz_iv_unregister(struct bz_iv *bziv);
+void bz_writer_free(struct bz_file *bzf);
+#ifdef HAVE_RB_GC_LOCATION
+void bz_writer_compact(void *ptr);
+#endif
 
 /* Instance methods */
 VALUE bz_writer_close(VALUE obj);
@@ -14,6 +24,8 @@ VALUE bz_writer_flush(VALUE obj);
 VALUE bz_writer_init(int argc, VALUE *argv, VALUE obj);
 VALUE bz_writer_write(VALUE obj, VALUE a);
 VALUE bz_writer_putc(VALUE obj, VALUE a);
+VALUE bz_writer_reset(int argc, VALUE *argv, VALUE obj);
+VALUE bz_writer_index(VALUE obj);
 
 /* Class methods */
 VALUE bz_writer_s_alloc(VALUE obj);
@@ -0,0 +1,21 @@
+# This file is mostly here for documentation purposes, do not require this
+
+#
+module Bzip2
+  # A Bzip2::Index knows where each block of a compressed input starts (at
+  # a bit offset, as bzip2 blocks aren't byte aligned) and how many bytes and
+  # lines of decompressed data come before it. Given to a Bzip2::Reader, it
+  # lets Bzip2::Reader#seek and Bzip2::Reader#seek_line start decompressing
+  # at the right block instead of at the beginning.
+  #
+  #     index = Bzip2::Index.build File.open('file.bz2', 'rb')
+  #     File.open('file.bz2.idx', 'wb') { |f| f << index.dump }
+  #
+  #     index = Bzip2::Index.load File.open('file.bz2.idx', 'rb') { |f| f.read }
+  #     Bzip2::Reader.open('file.bz2', :index => index) do |reader|
+  #       reader.seek_line 1_000_000
+  #       puts reader.gets
+  #     end
+  class Index
+  end
+end
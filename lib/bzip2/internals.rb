@@ -10,4 +10,8 @@ module Bzip2
   # @private
   class InternalStr
   end
+
+  # @private
+  class InternalMap
+  end
 end
@@ -0,0 +1,20 @@
+# This file is mostly here for documentation purposes, do not require this
+
+#
+module Bzip2
+  # A Bzip2::ParallelReader is a Bzip2::Reader which decompresses on several
+  # cores at once. The compressed input is scanned for the (bit aligned) block
+  # headers, and each block is decompressed on a pool of native threads while
+  # the decompressed data is handed out in order.
+  #
+  # Concatenated streams, like the ones written by Bzip2::ParallelWriter or
+  # +pbzip2+, are read as a whole.
+  #
+  #     Bzip2::ParallelReader.open('file.bz2', :threads => 4) do |f|
+  #       f.each_line { |line| puts line }
+  #     end
+  #
+  # @see Bzip2::ParallelReader#initialize The initialize method for options
+  class ParallelReader < Reader
+  end
+end
@@ -0,0 +1,22 @@
+# This file is mostly here for documentation purposes, do not require this
+
+#
+module Bzip2
+  # A Bzip2::ParallelWriter is a Bzip2::Writer which compresses on several
+  # cores at once, much like +pbzip2+ does. Data written to it is cut into
+  # chunks of <tt>blocks * 100k</tt> bytes which are compressed by a pool of
+  # native threads. Every chunk becomes a bzip2 stream of its own and the
+  # streams are written out in order, so the result is a valid concatenated
+  # .bz2 file.
+  #
+  #     Bzip2::ParallelWriter.open('file.bz2', 'wb', :threads => 4) do |f|
+  #       f << data
+  #     end
+  #
+  #     writer = Bzip2::ParallelWriter.new File.open('file.bz2', 'wb'),
+  #                                        :blocks => 9, :memory => 64 << 20
+  #
+  # @see Bzip2::ParallelWriter#initialize The initialize method for options
+  class ParallelWriter < Writer
+  end
+end
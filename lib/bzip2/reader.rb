@@ -18,10 +18,16 @@ module Bzip2
   #
   #     reader = Bzip2::Reader.new compressed_string
   #     reader = Bzip2::Reader.new Bzip2.compress('compress-me')
+  #
+  # Concatenated streams (as written by +pbzip2+ or appended to over time) are
+  # read as a whole in multistream mode
+  #
+  #     reader = Bzip2::Reader.open('file', :multistream => true)
   class Reader
     alias :each_line :each
     alias :closed :closed?
     alias :eoz :eoz?
     alias :eof :eof?
+    alias :tell :pos
   end
 end
@@ -1,3 +1,3 @@
 module Bzip2
-  VERSION = "0.2.7"
+  VERSION = "0.2.7".freeze
 end
\ No newline at end of file
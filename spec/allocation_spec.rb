@@ -0,0 +1,84 @@
+# encoding: UTF-8
+require 'spec_helper'
+
+# Budgets of ruby objects allocated by the hot paths. Going over one fails
+# with a list of where the allocations came from, as far as
+# ObjectSpace.trace_object_allocations can tell.
+describe "Allocations" do
+  def counting?
+    defined?(GC.stat) && GC.stat.key?(:total_allocated_objects)
+  end
+
+  def allocations
+    GC.start
+    before = GC.stat(:total_allocated_objects)
+    yield
+    GC.stat(:total_allocated_objects) - before
+  end
+
+  def sources
+    require 'objspace'
+    return [] unless ObjectSpace.respond_to?(:trace_object_allocations)
+    found = Hash.new(0)
+    generation = GC.count
+    ObjectSpace.trace_object_allocations { yield }
+    ObjectSpace.each_object do |obj|
+      file = ObjectSpace.allocation_sourcefile(obj) rescue nil
+      next unless file && ObjectSpace.allocation_generation(obj) >= generation
+      found["#{obj.class} #{file}:#{ObjectSpace.allocation_sourceline(obj)}"] += 1
+    end
+    found.sort_by { |_, count| -count }.first(5).map { |at, count| "#{count} x #{at}" }
+  rescue LoadError
+    []
+  end
+
+  # runs the block twice, only the second run is counted
+  def within(budget, &block)
+    if counting?
+      block.call
+      used = allocations(&block)
+      if used > budget
+        raise "#{used} allocations, more than #{budget}:\n  " + sources(&block).join("\n  ")
+      end
+    end
+  end
+
+  let(:data) { (0...10_000).map { |i| "line #{i}\n" }.join }
+  let(:compressed) { Bzip2.compress(data) }
+
+  it "costs one string per line with #each_line" do
+    within(10_000 + 20) { Bzip2::Reader.new(compressed).each_line { |line| } }
+  end
+
+  it "costs nothing per byte with #each_byte and #getc" do
+    within(20) { Bzip2::Reader.new(compressed).each_byte { |b| } }
+    within(20) do
+      reader = Bzip2::Reader.new(compressed)
+      10_000.times { reader.getc }
+    end
+  end
+
+  it "costs at most one string per #write" do
+    chunk = 'x' * 4096
+    within(1_000 + 20) do
+      writer = Bzip2::Writer.new
+      1_000.times { writer.write chunk }
+      writer.close
+    end
+  end
+
+  it "costs two strings per Bzip2.compress and Bzip2.uncompress" do
+    plain = 'data' * 100
+    within(2 * 100 + 10) { 100.times { Bzip2.compress(plain) } }
+    small = Bzip2.compress(plain)
+    within(2 * 100 + 10) { 100.times { Bzip2.uncompress(small) } }
+  end
+
+  it "hands out bytes of 0xff without stopping at them" do
+    bytes = [0x41, 0xff, 0x42, 0xff]
+    reader = Bzip2::Reader.new Bzip2.compress(bytes.pack('C*'))
+    all = []
+    reader.each_byte { |b| all << b }
+    all.should == bytes
+  end
+end
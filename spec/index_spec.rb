@@ -0,0 +1,86 @@
+# encoding: UTF-8
+require 'spec_helper'
+
+describe Bzip2::Index do
+  let(:file){ File.expand_path('../_index_', __FILE__) }
+  let(:data){ (0...60_000).map { |i| "#{i}: This is line #{i * 7919 % 10007}\n" }.join }
+
+  after(:each) do
+    File.delete(file) if File.exists?(file)
+  end
+
+  def compressed
+    writer = Bzip2::Writer.new nil, :blocks => 1
+    writer << data
+    writer.close + Bzip2.compress("last\n")
+  end
+
+  it "records the blocks of all streams" do
+    index = Bzip2::Index.build(compressed, :threads => 2)
+    index.blocks.should > 2
+    index.size.should == data.size + 5
+    index.lines.should == 60_001
+  end
+
+  it "seeks to any offset of a file through an index loaded from a dump" do
+    all = data + "last\n"
+    File.open(file, 'wb') { |f| f << compressed }
+    dump = Bzip2::Index.build(File.open(file, 'rb')).dump
+    index = Bzip2::Index.load(dump)
+
+    Bzip2::Reader.open(file, :index => index) do |reader|
+      [900_000, 10, 1_300_000, all.size - 5, 400_000].each do |offset|
+        reader.seek offset
+        reader.pos.should == offset
+        reader.read(30).should == all[offset, 30]
+      end
+      reader.read.should == all[400_030..-1]
+    end
+  end
+
+  it "seeks to a line" do
+    index = Bzip2::Index.build(compressed)
+    reader = Bzip2::Reader.new compressed, :index => index
+    reader.seek_line 45_000
+    reader.gets.should == "45000: This is line #{45_000 * 7919 % 10007}\n"
+    reader.lineno.should == 45_001
+    reader.seek_line 60_000
+    reader.gets.should == "last\n"
+    reader.seek_line 0
+    reader.gets.should == "0: This is line 0\n"
+  end
+
+  it "is recorded by a writer starting a new stream every so many bytes" do
+    writer = Bzip2::Writer.new nil, :blocks => 1, :index => 250_000
+    data.scan(/.{1,7777}/m) { |chunk| writer << chunk }
+    compressed = writer.close
+    writer.index.blocks.should == (data.size + 249_999) / 250_000
+    writer.index.lines.should == 60_000
+
+    reader = Bzip2::Reader.new compressed, :index => writer.index
+    [700_000, 250_000, 10].each do |offset|
+      reader.seek offset
+      reader.read(30).should == data[offset, 30]
+    end
+    Bzip2::Reader.new(compressed, :multistream => true).read.should == data
+  end
+
+  it "stops at the end when seeking past it" do
+    all = data + "last\n"
+    reader = Bzip2::Reader.new compressed, :index => Bzip2::Index.build(compressed)
+    reader.seek all.size + 1000
+    reader.pos.should == all.size
+    reader.read(10).should be_nil
+    reader.seek all.size - 3
+    reader.read(10).should == "st\n"
+    reader.read(10).should be_nil
+  end
+
+  it "can't seek backwards without an index" do
+    reader = Bzip2::Reader.new compressed
+    reader.read(10)
+    reader.seek 20
+    reader.read(5).should == data[20, 5]
+    lambda { reader.seek 0 }.should raise_error(IOError)
+  end
+end
@@ -0,0 +1,59 @@
+# encoding: UTF-8
+require 'spec_helper'
+require 'stringio'
+
+describe Bzip2::ParallelReader do
+  let(:file){ File.expand_path('../_parallel_', __FILE__) }
+  let(:data){ (0...60_000).map { |i| "#{i}: This is line #{i * 7919 % 10007}\n" }.join }
+
+  after(:each) do
+    File.delete(file) if File.exists?(file)
+    File.delete(file + '.bz2') if File.exists?(file + '.bz2')
+  end
+
+  it "reads a stream with many blocks written by bzip2" do
+    File.open(file, 'wb') { |f| f << data }
+    system("bzip2 -1 #{file}").should be_true
+
+    Bzip2::ParallelReader.open(file + '.bz2', :threads => 3) do |reader|
+      reader.read.should == data
+    end
+  end
+
+  it "reads all of a concatenation of streams" do
+    Bzip2::ParallelWriter.open(file, 'wb', :threads => 2, :blocks => 1) do |writer|
+      writer << data
+    end
+
+    lines = []
+    Bzip2::ParallelReader.open(file, :threads => 2) do |reader|
+      reader.each_line { |line| lines << line }
+      reader.should be_eof
+    end
+    lines.join.should == data
+  end
+
+  it "reads lines and characters like a Bzip2::Reader" do
+    reader = Bzip2::ParallelReader.new(Bzip2.compress("ab\ncd\n"), :threads => 1)
+    reader.gets.should == "ab\n"
+    reader.read(1).should == 'c'
+    reader.read.should == "d\n"
+    reader.read.should be_nil
+  end
+
+  it "raises on input which isn't bzip2 data or is truncated" do
+    lambda { Bzip2::ParallelReader.new('garbage').read }.should raise_error(Bzip2::Error)
+    lambda { Bzip2::ParallelReader.new(Bzip2.compress(data)[0, 1000]).read }.should raise_error(Bzip2::EOZError)
+  end
+
+  it "gives up on a corrupt block without reading the rest of the input" do
+    random = Random.new(42)
+    writer = Bzip2::Writer.new nil, :blocks => 1
+    writer << random.bytes(6 << 20)
+    packed = writer.close
+    packed.setbyte(300_000, packed.getbyte(300_000) ^ 0xff)
+    io = StringIO.new(packed)
+    lambda { Bzip2::ParallelReader.new(io, :threads => 2).read }.should raise_error(Bzip2::Error)
+    io.pos.should < packed.size / 2
+  end
+end
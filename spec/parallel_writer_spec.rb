@@ -0,0 +1,38 @@
+# encoding: UTF-8
+require 'spec_helper'
+
+describe Bzip2::ParallelWriter do
+  let(:file){ File.expand_path('../_parallel_', __FILE__) }
+  let(:data){ (0...30_000).map { |i| "#{i}: This is a line\n" }.join }
+
+  after(:each) do
+    File.delete(file) if File.exists?(file)
+  end
+
+  it "writes a concatenation of streams which bzip2 can read" do
+    Bzip2::ParallelWriter.open(file, 'wb', :threads => 3, :blocks => 1) do |writer|
+      writer << data
+    end
+
+    `bzip2 -dc #{file}`.should == data
+  end
+
+  it "keeps the streams in order when chunks are written piece by piece" do
+    writer = Bzip2::ParallelWriter.new(nil, :threads => 2, :blocks => 1, :memory => 1)
+    data.each_line { |line| writer << line }
+    File.open(file, 'wb') { |f| f << writer.flush }
+
+    `bzip2 -dc #{file}`.should == data
+  end
+
+  it "returns nothing when nothing was written" do
+    Bzip2::ParallelWriter.new.flush.should == ""
+  end
+
+  it "validates its options" do
+    lambda { Bzip2::ParallelWriter.new(nil, :threads => 0) }.should raise_error(ArgumentError)
+    lambda { Bzip2::ParallelWriter.new(nil, :blocks => 10) }.should raise_error(ArgumentError)
+    lambda { Bzip2::ParallelWriter.new(nil, :memory => 0) }.should raise_error(ArgumentError)
+    lambda { Bzip2::ParallelWriter.new(nil, :memory => -1) }.should raise_error(ArgumentError)
+  end
+end
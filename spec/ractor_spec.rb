@@ -0,0 +1,54 @@
+# encoding: UTF-8
+require 'spec_helper'
+require 'tmpdir'
+
+describe "Ractors" do
+  def ractors?
+    defined?(Ractor) && Ractor.respond_to?(:main)
+  end
+
+  def quietly
+    experimental = Warning[:experimental]
+    Warning[:experimental] = false
+    yield
+  ensure
+    Warning[:experimental] = experimental
+  end
+
+  def value(ractor)
+    ractor.respond_to?(:value) ? ractor.value : ractor.take
+  end
+
+  it "compresses and decompresses in several ractors at once" do
+    next unless ractors?
+    results = quietly do
+      (1..4).map do |i|
+        Ractor.new(i) do |n|
+          data = "ractor #{n}\n" * 10_000
+          writer = Bzip2::Writer.new nil, :blocks => 1
+          writer << data
+          packed = writer.close
+          [Bzip2::Reader.new(packed).read == data,
+            Bzip2.uncompress(Bzip2.compress(data)) == data]
+        end
+      end.map { |r| value(r) }
+    end
+    results.should == [[true, true]] * 4
+  end
+
+  it "writes to a file from another ractor once the writer is closed" do
+    next unless ractors?
+    Dir.mktmpdir do |dir|
+      path = File.join(dir, 'ractor.bz2')
+      quietly do
+        value(Ractor.new(path) do |p|
+          writer = Bzip2::Writer.new File.open(p, 'wb')
+          writer << 'from a ractor'
+          writer.close
+          nil
+        end)
+      end
+      Bzip2::Reader.open(path) { |r| r.read }.should == 'from a ractor'
+    end
+  end
+end
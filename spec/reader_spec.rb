@@ -1,5 +1,6 @@
 # encoding: UTF-8
 require 'spec_helper'
+require 'stringio'
 
 describe Bzip2::Writer do
   before(:each) do
@@ -159,6 +160,19 @@ describe Bzip2::Writer do
     41.should == count
   end
 
+  it "finds separators of several bytes in binary data" do
+    srand(7)
+    separator = [0xfe, 0x01].pack('C*')
+    data = (0...20_000).map { (rand(5) + 253) % 256 }.pack('C*') + 'end'
+    reader = Bzip2::Reader.new Bzip2.compress(data)
+    parts = []
+    while part = reader.gets(separator)
+      parts << part
+    end
+    parts.join.should == data
+    parts.size.should == data.scan(separator).size + 1
+  end
+
   it "reads the entire file or a specified length when using #read" do
     Bzip2::Reader.open(@file) do |file|
       file.read.should == @data.join
@@ -258,4 +272,79 @@ describe Bzip2::Writer do
     lambda { file.readline }.should raise_error(Bzip2::EOZError)
     file.close
   end
+
+  it "decompresses independent streams on several threads at once" do
+    data = (0...4).map { |i| "thread #{i}\n" * 100_000 }
+    threads = data.map do |d|
+      compressed = Bzip2.compress(d)
+      Thread.new { Bzip2::Reader.new(compressed).readlines.join }
+    end
+
+    threads.map { |t| t.value }.should == data
+  end
+
+  it "reads concatenated streams as one in multistream mode" do
+    string = Bzip2.compress("a\nb\n") + Bzip2.compress("") + Bzip2.compress("c\n")
+
+    Bzip2::Reader.new(string).read.should == "a\nb\n"
+
+    reader = Bzip2::Reader.new(string, :multistream => true)
+    reader.readlines.should == ["a\n", "b\n", "c\n"]
+    reader.lineno.should == 3
+    reader.should be_eof
+    reader.unused.should == ""
+  end
+
+  it "leaves trailing garbage after the last stream in #unused in multistream mode" do
+    string = Bzip2.compress("a\n") + Bzip2.compress("b\n") + "not bzip2"
+
+    reader = Bzip2::Reader.new(string, :multistream => true)
+    reader.read.should == "a\nb\n"
+    reader.unused.should == "not bzip2"
+  end
+
+  it "asks the io for read_size bytes at a time" do
+    io = StringIO.new(Bzip2.compress("line\n" * 10_000))
+    class << io
+      attr_reader :sizes
+      def read(n)
+        (@sizes ||= []) << n
+        super
+      end
+    end
+
+    Bzip2::Reader.new(io, :read_size => 100).read.should == "line\n" * 10_000
+    io.sizes.uniq.should == [100]
+    lambda { Bzip2::Reader.new(io, :read_size => 0) }.should raise_error(ArgumentError)
+  end
+
+  it "decompresses a memory mapped file via mmap" do
+    Bzip2::Reader.mmap(@file) do |reader|
+      reader.readlines.should == @data
+    end
+
+    File.open(@file, 'ab') { |f| f << Bzip2.compress("more\n") }
+    reader = Bzip2::Reader.mmap(@file, :multistream => true)
+    reader.readlines.should == @data + ["more\n"]
+    reader.close
+  end
+
+  it "decompresses a String in place, unaffected by later changes to it" do
+    string = File.read(@file) + "trailing"
+    reader = Bzip2::Reader.new(string)
+    reader.gets.should == @data[0]
+    string.replace("x" * string.size)
+    reader.readlines.should == @data[1..-1]
+    reader.unused.should == "trailing"
+  end
+
+  it "decompresses independent messages through one reader with reset" do
+    reader = Bzip2::Reader.new Bzip2.compress("first\n")
+    reader.gets.should == "first\n"
+
+    reader.reset Bzip2.compress("second\nthird\n")
+    reader.lineno.should == 0
+    reader.read.should == "second\nthird\n"
+    reader.close
+  end
 end
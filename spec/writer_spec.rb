@@ -1,5 +1,6 @@
 # encoding: UTF-8
 require 'spec_helper'
+require 'stringio'
 
 describe Bzip2::Writer do
   let(:file){ File.expand_path('../_10lines_', __FILE__) }
@@ -131,4 +132,221 @@ describe Bzip2::Writer do
     writer.close
     writer.should be_closed
   end
+
+  it "compresses independent streams on several threads at once" do
+    data = (0...4).map { |i| "thread #{i}\n" * 100_000 }
+    threads = data.map do |d|
+      Thread.new do
+        writer = Bzip2::Writer.new
+        writer << d
+        writer.flush
+      end
+    end
+
+    threads.map { |t| Bzip2.uncompress(t.value) }.should == data
+  end
+
+  it "hands the compressed data to the io in buffer_size pieces" do
+    io = Object.new
+    def io.writes; @writes ||= []; end
+    def io.write(str); writes << str; str.size; end
+    def io.closed?; false; end
+
+    srand(1)
+    data = (0...200_000).map { rand(1 << 30).to_s }.join("\n")
+    writer = Bzip2::Writer.new(io, :buffer_size => 100_000, :blocks => 1)
+    writer << data
+    writer.close
+
+    io.writes.size.should > 1
+    io.writes[0...-1].map { |s| s.size }.uniq.should == [100_000]
+    Bzip2.uncompress(io.writes.join).should == data
+  end
+
+  it "writes after data already buffered by ruby for a File" do
+    data = "some line\n" * 50_000
+    File.open(file, 'wb') do |f|
+      f << 'head'
+      writer = Bzip2::Writer.new(f)
+      writer << data
+      writer.flush
+    end
+
+    File.open(file, 'rb') do |f|
+      f.read(4).should == 'head'
+      Bzip2::Reader.new(f).read.should == data
+    end
+  end
+
+  it "round trips strings of any size through the one-shot methods" do
+    srand(2)
+    ["", "a", (0...300_000).map { rand(256).chr }.join, "b" * 2_000_000].each do |data|
+      compressed = Bzip2.compress(data)
+      compressed[0, 3].should == "BZh"
+      Bzip2.uncompress(compressed).should == data
+    end
+    lambda { Bzip2.uncompress(Bzip2.compress("abc")[0..-3]) }.should raise_error(Bzip2::EOZError)
+  end
+
+  it "picks the smallest block size which holds all of the data" do
+    Bzip2.compress("small")[0, 4].should == "BZh1"
+    Bzip2.compress("a" * 250_000)[0, 4].should == "BZh4"
+    Bzip2.compress("a" * 2_000_000)[0, 4].should == "BZh9"
+
+    writer = Bzip2::Writer.new(nil, :size_hint => 150_000)
+    writer << "data"
+    writer.flush[0, 4].should == "BZh2"
+  end
+
+  it "keeps the working memory of libbzip2 in a limited pool" do
+    limit = Bzip2.pool_limit
+    begin
+      Bzip2.pool_trim
+      Bzip2.uncompress(Bzip2.compress("a" * 10_000))
+      Bzip2.pool_size.should > 0
+      Bzip2.pool_size.should <= limit
+
+      Bzip2.pool_limit = 0
+      Bzip2.pool_size.should == 0
+      Bzip2.compress("a" * 10_000)
+      Bzip2.pool_size.should == 0
+    ensure
+      Bzip2.pool_limit = limit
+    end
+  end
+
+  it "compresses independent messages through one writer with reset" do
+    writer = Bzip2::Writer.new nil, :blocks => 1
+    messages = %w(first second third).map { |message| (writer << message).reset }
+    writer.close
+
+    messages.map { |data| Bzip2.uncompress(data) }.should == %w(first second third)
+    messages.first[0, 4].should == 'BZh1'
+  end
+
+  it "reports the memory of libbzip2 and survives being dropped unclosed" do
+    begin
+      require 'objspace'
+    rescue LoadError
+    end
+
+    if defined?(ObjectSpace.memsize_of)
+      writer = Bzip2::Writer.new
+      writer << 'data'
+      ObjectSpace.memsize_of(writer).should > 900_000
+      writer.close
+      ObjectSpace.memsize_of(writer).should < 100_000
+    end
+
+    io = StringIO.new
+    def io.closed?; false; end
+    10.times { Bzip2::Writer.new(nil) << 'data' }
+    Bzip2::Writer.new(io) << 'data'
+    GC.start
+    io.string.should == ''
+  end
+
+  it "lets writers on a file which were dropped unclosed be collected" do
+    require 'weakref'
+    refs = []
+    drop = lambda do
+      writer = Bzip2::Writer.new(File.open(file, 'wb'))
+      writer << 'data'
+      refs << WeakRef.new(writer)
+      nil
+    end
+    50.times { drop.call }
+    GC.start
+    GC.start
+    # the stack is scanned conservatively, which can keep the last writer
+    # or two around
+    refs.count { |ref| ref.weakref_alive? }.should <= 2
+  end
+
+  it "keeps track of unclosed writers moved by compaction" do
+    next unless GC.respond_to?(:verify_compaction_references)
+    holder = Struct.new(:io, :writer)
+    held = (1..200).map do |i|
+      io = StringIO.new
+      def io.closed?; false; end
+      writer = Bzip2::Writer.new(io)
+      writer << i.to_s
+      holder.new(io, writer)
+    end
+    GC.verify_compaction_references(:expand_heap => true, :toward => :empty)
+    held.each_with_index do |h, i|
+      lambda { Bzip2::Writer.new(h.io) }.should raise_error(ArgumentError)
+      h.writer.close
+      Bzip2::Reader.new(h.io.string).read.should == (i + 1).to_s
+    end
+
+    script = <<-RUBY
+      Held = (0..199).map do |i|
+        io = i < 10 ? File.open("#{file}.\#{i}", 'wb') : StringIO.new
+        w = Bzip2::Writer.new(io)
+        w << i.to_s
+        [w]
+      end
+      GC.verify_compaction_references(:expand_heap => true, :toward => :empty)
+    RUBY
+    begin
+      args = $LOAD_PATH.map { |dir| "-I#{dir}" }
+      system(RbConfig.ruby, *args, '-rbzip2', '-rstringio', '-e', script).should be_true
+      (0..9).each do |i|
+        Bzip2::Reader.open("#{file}.#{i}") { |r| r.read }.should == i.to_s
+      end
+    ensure
+      (0..9).each { |i| File.delete("#{file}.#{i}") if File.exist?("#{file}.#{i}") }
+    end
+  end
+
+  it "keeps track of many writers open on different ios at once" do
+    ios = (1..200).map do
+      io = StringIO.new
+      def io.closed?; false; end
+      io
+    end
+    writers = ios.map { |io| Bzip2::Writer.new(io) }
+    writers.each_with_index { |writer, i| writer << i.to_s }
+    writers.reverse.each { |writer| writer.close }
+
+    ios.map { |io| Bzip2.uncompress(io.string).to_i }.should == (0...200).to_a
+    lambda { Bzip2::Writer.new(ios.first) }.should_not raise_error
+  end
+
+  it "collects the output of a writer without an io in a plain string" do
+    writer = Bzip2::Writer.new
+    writer.to_io.singleton_methods.should == []
+    writer << 'data'
+    data = writer.close
+    data.class.should == String
+    data.singleton_methods.should == []
+    Bzip2.uncompress(data).should == 'data'
+  end
+
+  it "counts the bytes, calls and time of libbzip2 and the io" do
+    total = Bzip2.stats
+    io = StringIO.new
+    def io.closed?; false; end
+    writer = Bzip2::Writer.new io, :buffer_size => 1000
+    writer << 'a' * 100_000 << (1..20_000).map { |i| i.to_s }.join
+    writer.close
+
+    stats = writer.stats
+    stats[:bytes_in].should == 100_000 + (1..20_000).map { |i| i.to_s }.join.size
+    stats[:bytes_out].should == io.string.size
+    stats[:lib_calls].should > 1
+    stats[:io_writes].should == (io.string.size + 999) / 1000
+    stats[:lib_time].should > 0
+    stats[:peak_buffer].should == 1000
+
+    reader = Bzip2::Reader.new StringIO.new(io.string)
+    reader.read.size.should == stats[:bytes_in]
+    reader.stats[:bytes_out].should == stats[:bytes_in]
+    reader.stats[:io_reads].should > 0
+
+    Bzip2.stats[:bytes_in].should >= total[:bytes_in] + stats[:bytes_in] +
+      io.string.size
+    Bzip2.stats[:io_writes].should >= total[:io_writes] + stats[:io_writes]
+  end
 end